@@ -0,0 +1,103 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __CONTEXT_H__
+#define __CONTEXT_H__
+
+#include <isa.h>
+#include <device/map.h>
+#include <device/event.h>
+#include <memory/vaddr.h>
+
+#ifdef CONFIG_ITRACE
+// an instruction kept for the dump at a crash
+typedef struct {
+  vaddr_t pc;
+  uint8_t len;
+  uint8_t inst[sizeof(((ISADecodeInfo *)0)->inst)];
+} ITraceEntry;
+#endif
+
+/* Everything that belongs to one guest. The code reaches the context of
+ * the running guest through `nemu_ctx`, and its members through the
+ * global names defined below.
+ */
+typedef struct NEMUContext {
+  CPU_state cpu_state;
+  NEMUState run_state;
+  uint64_t nr_guest_inst;
+  uint8_t *pmem;
+  IOSpace mmio;
+  IOSpace pio;
+  // memory of the devices, see new_space()
+  uint8_t *io_space, *p_space;
+  // host time spent on running the guest in us
+  uint64_t host_time;
+#ifdef CONFIG_DEVICE
+  // the devices of the guest, see init_guest_device()
+  EventQueue events;
+#ifdef CONFIG_HAS_SERIAL
+  uint8_t *serial_base;
+#endif
+#ifdef CONFIG_HAS_TIMER
+  uint32_t *rtc_port_base;
+#ifdef CONFIG_ICOUNT_SKIP_IDLE
+  uint64_t rtc_last_poll;
+  int rtc_nr_poll;
+#endif
+#endif
+#endif
+#ifdef CONFIG_SOFT_TLB
+  // one TLB per MEM_TYPE_*
+  TLBEntry tlb[3][NR_TLB];
+#endif
+#ifdef CONFIG_ITRACE
+  // the last instructions traced, printed when NEMU aborts
+  ITraceEntry ringbuf[CONFIG_ITRACE_RINGBUF_DEPTH];
+  uint64_t ring_head;
+#endif
+} NEMUContext;
+
+#ifdef CONFIG_MULTI_GUEST
+/* Every thread runs the guest it switched to. To start another guest:
+ *
+ *   NEMUContext *ctx = nemu_ctx_new(); // with its own serial and timer
+ *   nemu_ctx_switch(ctx);
+ *   init_isa();
+ *   load_img_file("guest.bin");
+ *   cpu_exec(-1);
+ *
+ * The state of the execution path outside the guest, such as the
+ * watchpoints and the fast-forward target, belongs to the thread.
+ */
+extern __thread NEMUContext *nemu_ctx;
+NEMUContext* nemu_ctx_new();
+void nemu_ctx_free(NEMUContext *ctx);
+void nemu_ctx_switch(NEMUContext *ctx);
+#define THREAD_LOCAL __thread
+#else
+extern NEMUContext nemu_ctx_static;
+#define nemu_ctx (&nemu_ctx_static)
+#define THREAD_LOCAL
+#endif
+
+// load a raw image or an ELF into the running guest, return its size
+long load_img_file(const char *file);
+
+#define cpu             (nemu_ctx->cpu_state)
+#define nemu_state      (nemu_ctx->run_state)
+#define g_nr_guest_inst (nemu_ctx->nr_guest_inst)
+
+#endif
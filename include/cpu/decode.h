@@ -23,9 +23,25 @@ typedef struct Decode {
   vaddr_t snpc; // static next pc
   vaddr_t dnpc; // dynamic next pc
   ISADecodeInfo isa;
-  IFDEF(CONFIG_ITRACE, char logbuf[128]);
+  IFDEF(CONFIG_FUSION, bool fuse); // a fused pair may be run as one step
 } Decode;
 
+// predecoded instruction, produced once by the decode cache or the block
+// engine and then executed many times without matching the patterns again
+typedef struct Uop {
+  vaddr_t pc;
+  uint32_t inst;
+  uint8_t rd, rs1, rs2, type;
+  word_t imm;
+  const void *handler; // address of the execute body in decode_exec()
+#ifdef CONFIG_FUSION
+  // the pair formed with the next instruction, NULL if none
+  const void *fused;
+  uint8_t rd2;
+  word_t imm2;
+#endif
+} Uop;
+
 // --- pattern matching mechanism ---
 // pattern_decode()函数将模式字符串中的0和1抽取到整型变量key中, mask表示key的掩码, 而shift则表示opcode距离最低位的比特数量, 用于帮助编译器进行优化.
 // 具体地, 上述例子中:   pattern_decode("??????? ????? ????? ??? ????? 00101 11", 38, &key, &mask, &shift);
@@ -90,6 +106,21 @@ finish:
 
 
 // --- pattern matching wrappers for decode ---
+// tools/gen-decode turns the INSTPAT lists of the guest inst.c into decode
+// trees. The tree of a list is expanded by its first INSTPAT() and jumps
+// straight to the label of the matching pattern, named by the line of it.
+#if __has_include(<instpat-tree.h>)
+#include <instpat-tree.h>
+#endif
+
+#ifdef INSTPAT_TREE
+#define INSTPAT(pattern, ...) do { \
+  concat(__instpat_tree_, __LINE__) \
+  concat(__instpat_, __LINE__): __attribute__((unused)); \
+  INSTPAT_MATCH(s, ##__VA_ARGS__); \
+  goto *(__instpat_end); \
+} while (0)
+#else
 #define INSTPAT(pattern, ...) do { \
   uint64_t key, mask, shift; \
   pattern_decode(pattern, STRLEN(pattern), &key, &mask, &shift); \
@@ -98,6 +129,7 @@ finish:
     goto *(__instpat_end); \
   } \
 } while (0)
+#endif
 
 #define INSTPAT_START(name) { const void * __instpat_end = &&concat(__instpat_end_, name);
 #define INSTPAT_END(name)   concat(__instpat_end_, name): ; }
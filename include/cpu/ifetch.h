@@ -15,10 +15,10 @@
 
 #ifndef __CPU_IFETCH_H__
 
-#include <memory/vaddr.h>
+#include <memory/access.h>
 
 static inline uint32_t inst_fetch(vaddr_t *pc, int len) {
-  uint32_t inst = vaddr_ifetch(*pc, len);
+  uint32_t inst = vaddr_fetch(*pc, len);
   (*pc) += len;
   return inst;
 }
@@ -0,0 +1,67 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __DEVICE_EVENT_H__
+#define __DEVICE_EVENT_H__
+
+#include <common.h>
+
+/* Events are scheduled in guest instructions instead of host time, the
+ * CPU loop only compares g_nr_guest_inst with `event_deadline` and calls
+ * event_run() once it is reached.
+ */
+
+typedef void (*event_handler_t) ();
+
+#define MAX_EVENT 32
+
+typedef struct {
+  uint64_t when;
+  event_handler_t handler;
+} Event;
+
+// the events of a guest, kept in its context
+typedef struct {
+  // a binary min-heap ordered by `when`
+  Event heap[MAX_EVENT];
+  int nr;
+  // value of g_nr_guest_inst when the earliest event is due
+  uint64_t deadline;
+#ifdef CONFIG_ICOUNT
+  // instructions skipped by icount_skip(), they count as executed for the time
+  uint64_t icount_bias;
+#endif
+} EventQueue;
+
+// call `h` after the guest retires `delay` more instructions
+void event_add(uint64_t delay, event_handler_t h);
+// run the events which are due
+void event_run();
+// g_nr_guest_inst jumps from `from` to `to`, the pending events keep their delays
+void event_rebase(uint64_t from, uint64_t to);
+
+#define event_deadline (nemu_ctx->events.deadline)
+
+#ifdef CONFIG_ICOUNT
+// virtual time in us
+uint64_t icount_get_time();
+// let the virtual time jump to the earliest event
+void icount_skip();
+// the instructions skipped so far, kept by snapshots
+uint64_t icount_get_bias();
+void icount_set_bias(uint64_t bias);
+#endif
+
+#endif
@@ -17,9 +17,12 @@
 #define __DEVICE_MAP_H__
 
 #include <cpu/difftest.h>
+#include <memory/vaddr.h>
 
 typedef void(*io_callback_t)(uint32_t, int, bool);
 uint8_t* new_space(int size);
+// the memory given to all devices by new_space(), in the order of allocation
+uint8_t* device_space(size_t *size);
 
 typedef struct {
   const char *name;
@@ -34,21 +37,54 @@ static inline bool map_inside(IOMap *map, paddr_t addr) {
   return (addr >= map->low && addr <= map->high);
 }
 
-static inline int find_mapid_by_addr(IOMap *maps, int size, paddr_t addr) {
-  int i;
-  for (i = 0; i < size; i ++) {
-    if (map_inside(maps + i, addr)) {
-      // 由于NEMU中设备的行为是我们自定义的, 与REF中的标准设备的行为不完全一样
-      // (例如NEMU中的串口总是就绪的, 但QEMU中的串口也许并不是这样),
-      // 这导致在NEMU中执行输入指令的结果会和REF有所不同. 为了使得DiffTest可以正常工作,
-      // 框架代码在访问设备的过程中调用了difftest_skip_ref()函数
-      difftest_skip_ref();
-      return i;
-    }
+/* The maps of an address space are found through a two-level table
+ * of pages. A page holding a single map points to it, the bytes of a
+ * page shared by several maps are looked up in `sub`.
+ */
+typedef struct {
+  IOMap *map;
+  IOMap **sub;
+  // host memory of the page if a map without callback covers all of it
+  uint8_t *host;
+} IOPage;
+
+#define IO_DIR_SHIFT 10
+#define IO_NR_DIR (1 << (32 - PAGE_SHIFT - IO_DIR_SHIFT))
+
+typedef struct {
+  IOPage *dir[IO_NR_DIR];
+} IOSpace;
+
+static inline IOPage* io_page(IOSpace *s, paddr_t addr) {
+#ifdef PMEM64
+  if (addr >> 32) return NULL;
+#endif
+  IOPage *t = s->dir[(uint32_t)addr >> (PAGE_SHIFT + IO_DIR_SHIFT)];
+  return (t == NULL ? NULL : &t[(addr >> PAGE_SHIFT) & ((1 << IO_DIR_SHIFT) - 1)]);
+}
+
+static inline IOMap* fetch_map(IOSpace *s, paddr_t addr) {
+  IOPage *p = io_page(s, addr);
+  if (p == NULL) return NULL;
+  IOMap *map = (p->sub != NULL ? p->sub[addr & PAGE_MASK] : p->map);
+  if (map != NULL) {
+    // 由于NEMU中设备的行为是我们自定义的, 与REF中的标准设备的行为不完全一样
+    // (例如NEMU中的串口总是就绪的, 但QEMU中的串口也许并不是这样),
+    // 这导致在NEMU中执行输入指令的结果会和REF有所不同. 为了使得DiffTest可以正常工作,
+    // 框架代码在访问设备的过程中调用了difftest_skip_ref()函数
+    difftest_skip_ref();
   }
-  return -1;
+  return map;
 }
 
+// panic if the new map overlaps with another one
+IOMap* io_space_add(IOSpace *s, const char *name, paddr_t addr,
+        void *space, uint32_t len, io_callback_t callback);
+// free the maps of `s`, but not the memory of the devices
+void io_space_free(IOSpace *s);
+// host memory of a page without device callback, NULL if none
+uint8_t* mmio_page_host(paddr_t addr);
+
 // 端口映射I/O(port-mapped I/O)
 void add_pio_map(const char *name, ioaddr_t addr,
         void *space, uint32_t len, io_callback_t callback);
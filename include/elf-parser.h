@@ -24,6 +24,7 @@ void print_symbol_table(FILE* fp, Elf32_Ehdr eh, Elf32_Shdr sh_table[], int file
 void add_record_func_symbol_table(FILE* fp, Elf32_Ehdr eh, Elf32_Shdr sh_table[], int file_offset);
 
 void load_user_elf(char* file_name, int file_offset);
+bool find_record_func_addr(const char *name, vaddr_t *addr);
 
 void log_ftrace(bool is_func_call, vaddr_t current_pc, vaddr_t next_pc);
 
@@ -29,13 +29,17 @@ extern unsigned char isa_logo[];
 void init_isa();
 
 // reg
-extern CPU_state cpu;
 void isa_reg_display();
 word_t isa_reg_str2val(const char *name, bool *success);
 
 // exec
 struct Decode;
 int isa_exec_once(struct Decode *s);
+// the general register written by the instruction just run, 0 if none
+int isa_inst_rd(struct Decode *s);
+struct Uop;
+int isa_translate_block(vaddr_t pc, struct Uop *u, int max);
+int isa_exec_block(struct Decode *s, const struct Uop *u, int n);
 
 // memory
 enum { MMU_DIRECT, MMU_TRANSLATE, MMU_FAIL };
@@ -55,4 +59,7 @@ word_t isa_query_intr();
 bool isa_difftest_checkregs(CPU_state *ref_r, vaddr_t pc);
 void isa_difftest_attach();
 
+// the guest state, `cpu` among it
+#include <context.h>
+
 #endif
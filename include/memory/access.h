@@ -0,0 +1,106 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __MEMORY_ACCESS_H__
+#define __MEMORY_ACCESS_H__
+
+#include <isa.h>
+#include <memory/host.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <trace.h>
+
+/* Inlined guest memory accessors for the common case: the MMU is off and
+ * the access falls in pmem or in a device page without callback, such as
+ * the frame buffer. Everything else, MMIO, address translation and the
+ * memory tracer, takes the full vaddr_read()/vaddr_write() path.
+ */
+
+#define pmem_host(addr) (nemu_ctx->pmem + (addr) - CONFIG_MBASE)
+
+static inline bool pmem_direct(vaddr_t addr, int len, int type) {
+  return MUXNDEF(CONFIG_MTRACE, isa_mmu_check(addr, len, type) == MMU_DIRECT &&
+      addr - CONFIG_MBASE <= CONFIG_MSIZE - len, false);
+}
+
+// writes to pages holding cached code or not yet dirty take the slow path
+static inline bool pmem_direct_write(vaddr_t addr, int len) {
+  return pmem_direct(addr, len, MEM_TYPE_WRITE)
+    IFDEF(CONFIG_PMEM_PAGE_FLAGS, && !(pmem_page_flags[(addr - CONFIG_MBASE) >> PAGE_SHIFT] |
+          pmem_page_flags[(addr + len - 1 - CONFIG_MBASE) >> PAGE_SHIFT]));
+}
+
+static inline uint8_t* mmio_direct(vaddr_t addr, int len, int type) {
+#if defined(CONFIG_DEVICE) && !defined(CONFIG_MTRACE) && !defined(CONFIG_DTRACE)
+  if (isa_mmu_check(addr, len, type) != MMU_DIRECT || (addr & PAGE_MASK) > PAGE_SIZE - len) return NULL;
+  IOPage *p = io_page(&nemu_ctx->mmio, addr);
+  if (p == NULL || p->host == NULL) return NULL;
+  difftest_skip_ref();
+  return p->host + (addr & PAGE_MASK);
+#else
+  return NULL;
+#endif
+}
+
+#define def_access(bits) \
+  static inline uint##bits##_t vaddr_read##bits(vaddr_t addr) { \
+    if (likely(pmem_direct(addr, bits / 8, MEM_TYPE_READ))) return *(uint##bits##_t *)pmem_host(addr); \
+    uint8_t *h = mmio_direct(addr, bits / 8, MEM_TYPE_READ); \
+    if (h != NULL) return *(uint##bits##_t *)h; \
+    return vaddr_read(addr, bits / 8); \
+  } \
+  static inline void vaddr_write##bits(vaddr_t addr, uint##bits##_t data) { \
+    if (likely(pmem_direct_write(addr, bits / 8))) { *(uint##bits##_t *)pmem_host(addr) = data; return; } \
+    uint8_t *h = mmio_direct(addr, bits / 8, MEM_TYPE_WRITE); \
+    if (h != NULL) { *(uint##bits##_t *)h = data; return; } \
+    vaddr_write(addr, bits / 8, data); \
+  }
+
+def_access(8)
+def_access(16)
+def_access(32)
+IFDEF(CONFIG_ISA64, def_access(64))
+
+// `len` is a constant at most call sites, then only one accessor is left
+static inline __attribute__((always_inline)) word_t vaddr_load(vaddr_t addr, int len) {
+  word_t data;
+  switch (len) {
+    case 1: data = vaddr_read8(addr); break;
+    case 2: data = vaddr_read16(addr); break;
+    case 4: data = vaddr_read32(addr); break;
+    IFDEF(CONFIG_ISA64, case 8: data = vaddr_read64(addr); break);
+    default: data = vaddr_read(addr, len);
+  }
+  IFDEF(CONFIG_FLIGHT_RECORDER, flight_mem(TRACE_MEM_READ, addr, len, data));
+  return data;
+}
+
+static inline __attribute__((always_inline)) void vaddr_store(vaddr_t addr, int len, word_t data) {
+  IFDEF(CONFIG_FLIGHT_RECORDER, flight_mem(TRACE_MEM_WRITE, addr, len, data));
+  switch (len) {
+    case 1: vaddr_write8(addr, data); return;
+    case 2: vaddr_write16(addr, data); return;
+    case 4: vaddr_write32(addr, data); return;
+    IFDEF(CONFIG_ISA64, case 8: vaddr_write64(addr, data); return);
+    default: vaddr_write(addr, len, data);
+  }
+}
+
+static inline word_t vaddr_fetch(vaddr_t addr, int len) {
+  if (likely(pmem_direct(addr, len, MEM_TYPE_IFETCH))) return host_read(pmem_host(addr), len);
+  return vaddr_ifetch(addr, len);
+}
+
+#endif
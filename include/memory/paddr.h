@@ -27,10 +27,54 @@ uint8_t* guest_to_host(paddr_t paddr);
 /* convert the host virtual address in NEMU to guest physical address in the guest program */
 paddr_t host_to_guest(uint8_t *haddr);
 
+/* allocate and free the memory of a guest */
+uint8_t* new_pmem();
+void free_pmem(uint8_t *p);
+/* fill the memory of the running guest with zero */
+void pmem_clear();
+/* fill `size` bytes from `addr` with zero, sparse memory drops the pages
+ * instead of writing them, so both must be page aligned there */
+void pmem_zero(paddr_t addr, long size);
+/* the memory is changed without paddr_write(), e.g. by restoring a
+ * snapshot, drop the code and translations cached from it */
+void paddr_replaced();
+
+#ifdef CONFIG_PMEM_MAP_IMAGE
+/* map `size` bytes of file `fd` at offset `off` copy-on-write to guest
+ * physical address `addr`, return false if they are not page aligned */
+bool pmem_map_file(int fd, long off, paddr_t addr, long size);
+#endif
+
 static inline bool in_pmem(paddr_t addr) {
   return addr - CONFIG_MBASE < CONFIG_MSIZE;
 }
 
+#ifdef CONFIG_PMEM_PAGE_FLAGS
+/* one byte of flags per page of pmem, writes to a page with non-zero
+ * flags should take the slow path of paddr_write() */
+enum { PAGE_CODE = 1, PAGE_CLEAN = 2 };
+extern uint8_t pmem_page_flags[];
+uint8_t* paddr_page_flags_map();
+#endif
+
+#ifdef CONFIG_TRACK_CODE_PAGE
+/* mark the page holding `addr` as containing cached decoded instructions,
+ * later writes to this page will call code_invalidate() */
+void paddr_mark_code(paddr_t addr);
+/* provided by the decode cache or the block engine */
+void code_invalidate(paddr_t addr, int len);
+#endif
+
+#ifdef CONFIG_PMEM_DIRTY
+/* begin a new epoch of dirty tracking, return a mark against which the
+ * pages written from now on are dirty. Each user keeps its own mark,
+ * all pages are dirty against mark 0 */
+uint32_t paddr_dirty_mark();
+bool paddr_page_dirty(paddr_t addr, uint32_t mark);
+/* find the first dirty page at or above `*addr`, false if none */
+bool paddr_next_dirty(paddr_t *addr, uint32_t mark);
+#endif
+
 word_t paddr_read(paddr_t addr, int len);
 void paddr_write(paddr_t addr, int len, word_t data);
 
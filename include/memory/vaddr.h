@@ -26,4 +26,19 @@ void vaddr_write(vaddr_t addr, int len, word_t data);
 #define PAGE_SIZE         (1ul << PAGE_SHIFT)
 #define PAGE_MASK         (PAGE_SIZE - 1)
 
+#ifdef CONFIG_SOFT_TLB
+#define NR_TLB 256
+
+/* Map the guest virtual page `tag` to pmem, the host address of
+ * a guest address `addr` in the page is `off + addr`.
+ * The lowest bit of `tag` is set for a valid entry.
+ */
+typedef struct {
+  vaddr_t tag;
+  uintptr_t off;
+} TLBEntry;
+
+void tlb_flush();
+#endif
+
 #endif
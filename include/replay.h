@@ -0,0 +1,50 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <common.h>
+
+/* Inputs which depend on the host are recorded in a log shared by all
+ * checkpoints, so a run restarted from one of them gets the same inputs
+ * again. An input is keyed by the instruction count at which it is read,
+ * the rest of the log is dropped once the run takes another path.
+ */
+
+#ifdef CONFIG_REPLAY
+// fill `buf` with the input recorded here and return true if there is one
+bool replay_input(void *buf, size_t len);
+void record_input(const void *buf, size_t len);
+// drop the inputs recorded after this point
+void replay_truncate();
+bool replay_log_full();
+
+// set while sdb runs again over instructions which have been run, the
+// output of the guest is not repeated then
+extern bool replay_mute;
+#else
+static inline bool replay_input(void *buf, size_t len) { return false; }
+static inline void record_input(const void *buf, size_t len) {}
+#endif
+
+// the value of `expr`, or the recorded one when replaying
+#define REPLAY_INPUT(type, expr) ({ \
+  type __v; \
+  if (!replay_input(&__v, sizeof(__v))) { __v = (expr); record_input(&__v, sizeof(__v)); } \
+  __v; \
+})
+
+#endif
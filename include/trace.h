@@ -0,0 +1,128 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdint.h>
+
+/* The binary trace is a TraceHeader followed by fixed-size records, which
+ * are written in the order each thread emits them. tools/trace-render
+ * turns it back into the text of the tracers. This header is also built
+ * into the tool, so it does not depend on the configuration.
+ */
+
+#define TRACE_MAGIC "NEMUTRAC"
+#define TRACE_VERSION 1
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  char isa[20];
+} TraceHeader;
+
+enum {
+  TRACE_INST,      // a = pc, b = instruction, len = its bytes
+  TRACE_MEM_READ,  // a = address, len = bytes
+  TRACE_MEM_WRITE, // a = address, b = data, len = bytes
+  TRACE_CALL,      // a = pc, b = target
+  TRACE_RET,       // a = pc, b = target
+  TRACE_EXCP,      // a = epc, b = cause
+  TRACE_DEV_READ,  // a = address, len = bytes
+  TRACE_DEV_WRITE, // a = address, b = data, len = bytes
+  // names [a, a + arg) with the 8 characters in b, len is the index of
+  // the chunk for a name longer than that
+  TRACE_FUNC_NAME,
+  TRACE_DEV_NAME,
+};
+
+typedef struct {
+  uint8_t type;
+  uint8_t len;
+  uint16_t thread;
+  uint32_t arg;
+  uint64_t nr_inst;
+  uint64_t a, b;
+} TraceRecord;
+
+/* The flight recorder keeps the last events in a ring mapped from a file,
+ * so they are still there after NEMU crashes or is killed. The file is a
+ * FlightHeader, padded to FLIGHT_DATA_OFFSET, followed by the ring.
+ */
+
+#define FLIGHT_MAGIC "NEMUFLIT"
+#define FLIGHT_VERSION 1
+#define FLIGHT_DATA_OFFSET 4096
+
+typedef struct {
+  TraceHeader h;
+  uint32_t record_size;
+  uint64_t nr_record; // slots of the ring, a power of 2
+  uint64_t head;      // records written so far, the last ones are kept
+} FlightHeader;
+
+typedef struct {
+  uint8_t type;  // TRACE_INST, TRACE_MEM_READ or TRACE_MEM_WRITE
+  uint8_t len;   // bytes of the instruction or the access
+  uint8_t rd;    // the register written by the instruction, 0 if none
+  uint8_t pad;
+  uint32_t inst; // the first 4 bytes of the instruction
+  uint64_t a;    // pc or address
+  uint64_t b;    // the value written to rd, or the data
+} FlightRecord;
+
+/* The branch trace only keeps where the control flow leaves the sequence,
+ * the instructions in between are found again in the image. The file is a
+ * BTraceHeader followed by chunks, each a BTraceChunk and `size` bytes of
+ * entries, so the chunks can be decoded apart. An entry is the number of
+ * instructions run in sequence, the last of them jumping, then the
+ * distance from the next instruction to the target. Both are LEB128
+ * varints, the distance is zigzag encoded. A distance of 0 ends the chunk
+ * without a jump.
+ */
+
+#define BTRACE_MAGIC "NEMUBTRC"
+#define BTRACE_VERSION 1
+
+typedef struct {
+  TraceHeader h;
+  uint64_t reset_vector; // where a raw image is loaded
+} BTraceHeader;
+
+typedef struct {
+  uint32_t size;
+  uint32_t nr_entry;
+  uint64_t pc;      // where the chunk starts
+  uint64_t nr_inst; // instructions run before it
+} BTraceChunk;
+
+void trace_emit(int type, int len, uint64_t a, uint64_t b);
+void trace_name(int type, uint64_t addr, uint32_t size, const char *name);
+// write out the records which are left
+void trace_close();
+
+struct Decode;
+void flight_inst(struct Decode *s);
+void flight_mem(int type, uint64_t addr, int len, uint64_t data);
+
+// instructions run since the last jump
+extern uint64_t btrace_run;
+void btrace_jump(uint64_t snpc, uint64_t dnpc);
+// called when cpu_exec() starts and stops running at `pc`
+void btrace_sync(uint64_t pc);
+void btrace_pause(uint64_t pc);
+void btrace_close();
+
+#endif
@@ -16,6 +16,13 @@
 -include $(NEMU_HOME)/../Makefile
 include $(NEMU_HOME)/scripts/build.mk
 
+$(INSTPAT_TREE): $(INSTPAT_SRC) $(GEN_DECODE)
+	@echo + GEN $@
+	@mkdir -p $(dir $@)
+	@$(GEN_DECODE) $< > $@.tmp
+	@mv $@.tmp $@
+$(OBJ_DIR)/$(INSTPAT_SRC:.c=.o): $(INSTPAT_TREE)
+
 include $(NEMU_HOME)/tools/difftest.mk
 
 compile_git:
@@ -16,6 +16,9 @@
 #include <cpu/cpu.h>
 #include <cpu/decode.h>
 #include <cpu/difftest.h>
+#include <device/event.h>
+#include <replay.h>
+#include <trace.h>
 #include <locale.h>
 
 /* The assembly code of instructions executed is only output to the screen
@@ -25,101 +28,250 @@
  */
 #define MAX_INST_TO_PRINT 10
 
-CPU_state cpu = {};
-uint64_t g_nr_guest_inst = 0;
-static uint64_t g_timer = 0; // unit: us
-static bool g_print_step = false;
+#define g_timer (nemu_ctx->host_time) // unit: us
+static THREAD_LOCAL bool g_print_step = false;
 
-#define RING_BUF_SIZE 10
-char ringbuf[RING_BUF_SIZE][128];
-int head = 0;
-int ring_counter = 0;
+#ifdef CONFIG_ITRACE
+#define RINGBUF_DEPTH CONFIG_ITRACE_RINGBUF_DEPTH
 
-void ringbuf_push(char *str) {
-  strcpy(ringbuf[head], str);
-  head = (head + 1) % RING_BUF_SIZE;
-  if (ring_counter != RING_BUF_SIZE)
-  {
-    ring_counter++;
+// format an instruction as the instruction tracer prints it
+static void itrace_format(char *buf, int size, vaddr_t pc, const uint8_t *inst, int ilen) {
+  char *p = buf;
+  p += snprintf(p, size, "   ["FMT_WORD "]:", pc);
+  int i;
+#ifdef CONFIG_ISA_x86
+  for (i = 0; i < ilen; i ++) {
+#else
+  for (i = ilen - 1; i >= 0; i --) {
+#endif
+    p += snprintf(p, 4, " %02x", inst[i]);
   }
+  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
+  int space_len = ilen_max - ilen;
+  if (space_len < 0) space_len = 0;
+  space_len = space_len * 3 + 1;
+  memset(p, ' ', space_len);
+  p += space_len;
+
+  const char* disassemble_cached(uint64_t pc, const uint8_t *code, int nbyte);
+  snprintf(p, buf + size - p, "%s", disassemble_cached(MUXDEF(CONFIG_ISA_x86, pc + ilen, pc), inst, ilen));
 }
 
+// keep the raw instruction, it is only disassembled when printed
+void ringbuf_push(Decode *s) {
+  NEMUContext *c = nemu_ctx;
+  ITraceEntry *e = &c->ringbuf[c->ring_head % RINGBUF_DEPTH];
+  e->pc = s->pc;
+  e->len = s->snpc - s->pc;
+  memcpy(e->inst, &s->isa.inst, sizeof(e->inst));
+  c->ring_head ++;
+}
+#endif
+
 void ringbuf_print() {
+#ifdef CONFIG_ITRACE
+  NEMUContext *c = nemu_ctx;
   puts("==========Instruction Debug===========\n");
-  int start = 0;
-  if (ring_counter == RING_BUF_SIZE) {start = head % RING_BUF_SIZE;}
-  for (int i = 0; i < ring_counter; i++)
-  {
-    puts(ringbuf[start]);
-    start = (start + 1) % RING_BUF_SIZE;
+  uint64_t start = (c->ring_head > RINGBUF_DEPTH ? c->ring_head - RINGBUF_DEPTH : 0);
+  for (uint64_t i = start; i < c->ring_head; i ++) {
+    ITraceEntry *e = &c->ringbuf[i % RINGBUF_DEPTH];
+    char buf[128];
+    itrace_format(buf, sizeof(buf), e->pc, e->inst, e->len);
+    puts(buf);
   }
   puts("==========End Instruction Debug===========\n");
+#endif
 }
 
-void device_update();
 bool check_wp_value_chage(word_t * old_value, word_t *change_value);
+bool wp_active();
+bool log_enable();
+
+// the instruction tracer can be switched off at run time, see cmd_trace()
+bool g_itrace_enable = true;
+
+/* execute() is specialized for every combination of the features below,
+ * so checks for features which are off cost nothing at run time.
+ * cpu_exec() picks the version matching the current state.
+ */
+enum {
+  EXEC_ITRACE   = 1 << 0, // log and print the instructions
+  EXEC_WATCH    = 1 << 1, // check watch points
+  EXEC_DIFFTEST = 1 << 2, // compare with the reference
+  EXEC_UNTIL_PC = 1 << 3, // stop when reaching the fast-forward pc
+  NR_EXEC_VARIANT = 1 << 4,
+};
+
+/* Fast-forward runs without any instrumentation until the target
+ * instruction count or pc is reached, then switches the instrumentation
+ * requested for this run on.
+ */
+static THREAD_LOCAL struct {
+  bool on;
+  bool by_pc;
+  uint64_t inst;
+  vaddr_t pc;
+  // state to restore when the target is reached
+  bool ftrace, difftest;
+} ff = {};
 
-static void trace_and_difftest(Decode *_this, vaddr_t dnpc) {
+static inline __attribute__((always_inline))
+void trace_and_difftest(Decode *_this, vaddr_t dnpc, int nr, int feature) {
 #ifdef CONFIG_ITRACE_COND
+  if (feature & EXEC_ITRACE) {
+    char logbuf[128];
+    int ilen = _this->snpc - _this->pc;
 #ifdef CONFIG_ITRACE_RINGBUF_ONLU
-  if (ITRACE_COND) { ringbuf_push(_this->logbuf); }
+    if (ITRACE_COND) { ringbuf_push(_this); }
 #else
-  if (ITRACE_COND) { log_write("%s\n", _this->logbuf); }
-  if (ITRACE_COND) { ringbuf_push(_this->logbuf); }
+#ifdef CONFIG_TRACE_BINARY
+    if (ITRACE_COND) {
+      // the record keeps the first 8 bytes of a longer instruction
+      uint64_t inst = 0;
+      memcpy(&inst, &_this->isa.inst, ilen < 8 ? ilen : 8);
+      trace_emit(TRACE_INST, ilen, _this->pc, inst);
+    }
+#else
+    if (ITRACE_COND && log_enable()) {
+      itrace_format(logbuf, sizeof(logbuf), _this->pc, (uint8_t *)&_this->isa.inst, ilen);
+      log_write("%s\n", logbuf);
+    }
+#endif
+    if (ITRACE_COND) { ringbuf_push(_this); }
 #endif
+    if (g_print_step) {
+      itrace_format(logbuf, sizeof(logbuf), _this->pc, (uint8_t *)&_this->isa.inst, ilen);
+      puts(logbuf);
+    }
+  }
 #endif
-  if (g_print_step) { IFDEF(CONFIG_ITRACE, puts(_this->logbuf)); }
-  IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc));
+  if (feature & EXEC_DIFFTEST) { IFDEF(CONFIG_DIFFTEST, difftest_step(_this->pc, dnpc, nr)); }
   word_t old_value, new_value;
-  if (check_wp_value_chage(&old_value, &new_value))
+  if ((feature & EXEC_WATCH) && check_wp_value_chage(&old_value, &new_value))
   {
     // TODO: the halt_ret is right?
     set_nemu_state(NEMU_STOP, _this->pc, 0);
-    printf("Watch Point value changed after executing instruction at pc = " FMT_WORD ", changes from: %x to %x\n", _this->pc, old_value, new_value);
+    if (!MUXDEF(CONFIG_REPLAY, replay_mute, false)) {
+      printf("Watch Point value changed after executing instruction at pc = " FMT_WORD ", changes from: %x to %x\n", _this->pc, old_value, new_value);
+    }
   }
 }
 
-static void exec_once(Decode *s, vaddr_t pc) {
+#ifdef CONFIG_ENGINE_BLOCK
+uint64_t block_exec(Decode *s, uint64_t n, vaddr_t stop_pc);
+
+static inline __attribute__((always_inline))
+void execute_template(uint64_t n, int feature) {
+  Decode s;
+  while (n > 0) {
+    if ((feature & EXEC_UNTIL_PC) && cpu.pc == ff.pc) break;
+    uint64_t nr = block_exec(&s, n, (feature & EXEC_UNTIL_PC) ? ff.pc : (vaddr_t)-1);
+    g_nr_guest_inst += nr;
+    n -= nr;
+    // watch points are checked once per block
+    trace_and_difftest(&s, cpu.pc, nr, feature);
+    if (nemu_state.state != NEMU_RUNNING) break;
+    IFDEF(CONFIG_DEVICE, if (unlikely(g_nr_guest_inst >= event_deadline)) event_run());
+  }
+}
+#else
+// return the number of instructions executed
+static inline __attribute__((always_inline))
+int exec_once(Decode *s, vaddr_t pc, int feature) {
   s->pc = pc;
   s->snpc = pc;
-  isa_exec_once(s);
-  cpu.pc = s->dnpc;
-#ifdef CONFIG_ITRACE
-  char *p = s->logbuf;
-  p += snprintf(p, sizeof(s->logbuf), "   ["FMT_WORD "]:", s->pc);
-  int ilen = s->snpc - s->pc;
-  int i;
-  uint8_t *inst = (uint8_t *)&s->isa.inst;
-#ifdef CONFIG_ISA_x86
-  for (i = 0; i < ilen; i ++) {
+#ifdef CONFIG_FUSION
+  int nr = isa_exec_once(s); // 2 for a fused pair
 #else
-  for (i = ilen - 1; i >= 0; i --) {
+  int nr = 1;
+  isa_exec_once(s);
 #endif
-    p += snprintf(p, 4, " %02x", inst[i]);
-  }
-  int ilen_max = MUXDEF(CONFIG_ISA_x86, 8, 4);
-  int space_len = ilen_max - ilen;
-  if (space_len < 0) space_len = 0;
-  space_len = space_len * 3 + 1;
-  memset(p, ' ', space_len);
-  p += space_len;
-
-  void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte);
-  disassemble(p, s->logbuf + sizeof(s->logbuf) - p,
-      MUXDEF(CONFIG_ISA_x86, s->snpc, s->pc), (uint8_t *)&s->isa.inst, ilen);
+  cpu.pc = s->dnpc;
+  IFDEF(CONFIG_FLIGHT_RECORDER, flight_inst(s));
+#ifdef CONFIG_BTRACE
+  btrace_run += nr;
+  if (unlikely(s->dnpc != s->snpc)) btrace_jump(s->snpc, s->dnpc);
 #endif
+  return nr;
 }
 
-static void execute(uint64_t n) {
+static inline __attribute__((always_inline))
+void execute_template(uint64_t n, int feature) {
   Decode s;
-  for (;n > 0; n --) {
-    exec_once(&s, cpu.pc);
-    g_nr_guest_inst ++;
-    trace_and_difftest(&s, cpu.pc);
+  while (n > 0) {
+    if ((feature & EXEC_UNTIL_PC) && cpu.pc == ff.pc) break;
+    // never run past `n` or the fast-forward pc with a fused pair, and
+    // trace, check watchpoints or check against the reference one
+    // instruction a step
+    IFDEF(CONFIG_FUSION, s.fuse = (n > 1) && !(feature & (EXEC_ITRACE | EXEC_WATCH | EXEC_DIFFTEST | EXEC_UNTIL_PC)));
+    int nr = exec_once(&s, cpu.pc, feature);
+    g_nr_guest_inst += nr;
+    n -= nr;
+    trace_and_difftest(&s, cpu.pc, nr, feature);
     if (nemu_state.state != NEMU_RUNNING) break;
-    IFDEF(CONFIG_DEVICE, device_update());
+    IFDEF(CONFIG_DEVICE, if (unlikely(g_nr_guest_inst >= event_deadline)) event_run());
   }
 }
+#endif
+
+#define def_execute(f) static void concat(execute_, f)(uint64_t n) { execute_template(n, f); }
+def_execute(0) def_execute(1) def_execute(2) def_execute(3)
+def_execute(4) def_execute(5) def_execute(6) def_execute(7)
+def_execute(8) def_execute(9) def_execute(10) def_execute(11)
+def_execute(12) def_execute(13) def_execute(14) def_execute(15)
+
+static void (*const execute_variant[NR_EXEC_VARIANT])(uint64_t) = {
+  execute_0, execute_1, execute_2, execute_3,
+  execute_4, execute_5, execute_6, execute_7,
+  execute_8, execute_9, execute_10, execute_11,
+  execute_12, execute_13, execute_14, execute_15,
+};
+
+static int exec_feature() {
+  int feature = 0;
+  if (MUXDEF(CONFIG_ITRACE, g_itrace_enable || g_print_step, false)) feature |= EXEC_ITRACE;
+  if (wp_active()) feature |= EXEC_WATCH;
+  if (MUXDEF(CONFIG_DIFFTEST, difftest_is_on(), false)) feature |= EXEC_DIFFTEST;
+  return feature;
+}
+
+extern THREAD_LOCAL bool g_ftrace_enable;
+
+void cpu_fast_forward(bool by_pc, uint64_t target) {
+  ff.on = true;
+  ff.by_pc = by_pc;
+  if (by_pc) ff.pc = target;
+  else ff.inst = target;
+  ff.ftrace = g_ftrace_enable;
+  ff.difftest = MUXDEF(CONFIG_DIFFTEST, difftest_is_on(), false);
+  g_ftrace_enable = false;
+  IFDEF(CONFIG_DIFFTEST, difftest_detach());
+}
+
+static void fast_forward_done() {
+  ff.on = false;
+  g_ftrace_enable = ff.ftrace;
+  // the reference has fallen behind, copy the whole state over
+  if (ff.difftest) { IFDEF(CONFIG_DIFFTEST, difftest_attach()); }
+  Log("fast-forward done at pc = " FMT_WORD " after %" PRIu64 " instructions", cpu.pc, g_nr_guest_inst);
+}
+
+// return the number of instructions left to execute
+static uint64_t fast_forward(uint64_t n) {
+  uint64_t step = n;
+  if (!ff.by_pc) {
+    uint64_t left = (g_nr_guest_inst >= ff.inst ? 0 : ff.inst - g_nr_guest_inst);
+    if (left < step) step = left;
+  }
+  uint64_t start = g_nr_guest_inst;
+  if (step > 0) execute_variant[ff.by_pc ? EXEC_UNTIL_PC : 0](step);
+  n -= g_nr_guest_inst - start;
+  if (nemu_state.state == NEMU_RUNNING &&
+      (ff.by_pc ? cpu.pc == ff.pc : g_nr_guest_inst >= ff.inst)) {
+    fast_forward_done();
+  }
+  return n;
+}
 
 static void statistic() {
   IFNDEF(CONFIG_TARGET_AM, setlocale(LC_NUMERIC, ""));
@@ -134,6 +286,8 @@ void assert_fail_msg() {
   isa_reg_display();
   statistic();
   ringbuf_print();
+  IFDEF(CONFIG_TRACE_BINARY, trace_close());
+  IFDEF(CONFIG_BTRACE, btrace_close());
 }
 
 /* Simulate how the CPU works. */
@@ -148,7 +302,13 @@ void cpu_exec(uint64_t n) {
 
   uint64_t timer_start = get_time();
 
-  execute(n);
+  IFDEF(CONFIG_BTRACE, btrace_sync(cpu.pc));
+  if (ff.on) n = fast_forward(n);
+  if (n > 0 && nemu_state.state == NEMU_RUNNING) {
+    void (*execute)(uint64_t) = execute_variant[exec_feature()];
+    execute(n);
+  }
+  IFDEF(CONFIG_BTRACE, btrace_pause(cpu.pc));
 
   uint64_t timer_end = get_time();
   g_timer += timer_end - timer_start;
@@ -18,6 +18,7 @@
 #include <isa.h>
 #include <cpu/cpu.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <utils.h>
 #include <difftest-def.h>
 
@@ -31,11 +32,16 @@ void (*ref_difftest_raise_intr)(uint64_t NO) = NULL;
 static bool is_skip_ref = false;
 static int skip_dut_nr_inst = 0;
 static bool difftest_on = true;
+#ifdef CONFIG_PMEM_DIRTY
+static uint32_t detach_mark = 0;
+#endif
 
 void difftest_detach()
 {
   // detach命令用于退出DiffTest模式, 之后DUT执行的所有指令将不再与REF进行比对. 实现方式非常简单, 只需要让difftest_step(), difftest_skip_dut()和difftest_skip_ref()直接返回即可.
   difftest_on = false;
+  // the memory of REF is the same now, only the pages written later should be copied
+  IFDEF(CONFIG_PMEM_DIRTY, detach_mark = paddr_dirty_mark());
 }
 
 void difftest_attach() {
@@ -43,12 +49,28 @@ void difftest_attach() {
 
   // ref_difftest_memcpy(RESET_VECTOR, guest_to_host(RESET_VECTOR), img_size, DIFFTEST_TO_REF); --> seems only copy the image/code not include the data part
   // TODO: this is not fully test
+#ifdef CONFIG_PMEM_DIRTY
+  // copy each run of dirty pages
+  paddr_t addr = CONFIG_MBASE;
+  while (paddr_next_dirty(&addr, detach_mark)) {
+    paddr_t end = addr;
+    while (end - CONFIG_MBASE < CONFIG_MSIZE && paddr_page_dirty(end, detach_mark)) end += PAGE_SIZE;
+    ref_difftest_memcpy(addr, guest_to_host(addr), end - addr, DIFFTEST_TO_REF);
+    if (end - CONFIG_MBASE >= CONFIG_MSIZE) break;
+    addr = end;
+  }
+#else
   ref_difftest_memcpy(CONFIG_MBASE, guest_to_host(CONFIG_MBASE), CONFIG_MSIZE, DIFFTEST_TO_REF);
+#endif
   ref_difftest_regcpy(&cpu, DIFFTEST_TO_REF);
   // TODO: there should be some logic related to isa
   isa_difftest_attach();
 }
 
+bool difftest_is_on() {
+  return difftest_on;
+}
+
 // this is used to let ref skip instructions which
 // can not produce consistent behavior with NEMU
 // 有的指令不能让REF直接执行, 或者执行后的行为肯定与NEMU不同, 例如nemu_trap指令,
@@ -132,7 +154,8 @@ static void checkregs(CPU_state *ref, vaddr_t pc) {
   }
 }
 
-void difftest_step(vaddr_t pc, vaddr_t npc) {
+// `nr` is the number of instructions retired by DUT in this step
+void difftest_step(vaddr_t pc, vaddr_t npc, int nr) {
   if (!difftest_on) return;
 
   CPU_state ref_r;
@@ -144,8 +167,8 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
       checkregs(&ref_r, npc);
       return;
     }
-    skip_dut_nr_inst --;
-    if (skip_dut_nr_inst == 0)
+    skip_dut_nr_inst -= nr;
+    if (skip_dut_nr_inst <= 0)
       panic("can not catch up with ref.pc = " FMT_WORD " at pc = " FMT_WORD, ref_r.pc, pc);
     return;
   }
@@ -157,7 +180,7 @@ void difftest_step(vaddr_t pc, vaddr_t npc) {
     return;
   }
 
-  ref_difftest_exec(1);
+  ref_difftest_exec(nr);
   ref_difftest_regcpy(&ref_r, DIFFTEST_TO_DUT);
 
   checkregs(&ref_r, pc);
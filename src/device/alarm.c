@@ -15,6 +15,7 @@
 
 #include <common.h>
 #include <device/alarm.h>
+#include <device/event.h>
 #include <sys/time.h>
 #include <signal.h>
 
@@ -24,6 +25,10 @@ static alarm_handler_t handler[MAX_HANDLER] = {};
 static int idx = 0;
 
 void add_alarm_handle(alarm_handler_t h) {
+  // the devices of every guest register the same handlers
+  for (int i = 0; i < idx; i ++) {
+    if (handler[i] == h) return;
+  }
   assert(idx < MAX_HANDLER);
   handler[idx ++] = h;
 }
@@ -35,6 +40,19 @@ static void alarm_sig_handler(int signum) {
   }
 }
 
+#ifdef CONFIG_ICOUNT
+#define ALARM_INTERVAL ((uint64_t)CONFIG_ICOUNT_MHZ * 1000000 / TIMER_HZ)
+
+static void alarm_event() {
+  alarm_sig_handler(0);
+  event_add(ALARM_INTERVAL, alarm_event);
+}
+
+void init_alarm() {
+  // fire in virtual time, see CONFIG_ICOUNT
+  event_add(ALARM_INTERVAL, alarm_event);
+}
+#else
 void init_alarm() {
   struct sigaction s;
   memset(&s, 0, sizeof(s));
@@ -49,3 +67,4 @@ void init_alarm() {
   ret = setitimer(ITIMER_VIRTUAL, &it, NULL);
   Assert(ret == 0, "Can not set timer");
 }
+#endif
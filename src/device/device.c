@@ -15,7 +15,9 @@
 
 #include <common.h>
 #include <utils.h>
+#include <context.h>
 #include <device/alarm.h>
+#include <device/event.h>
 #ifndef CONFIG_TARGET_AM
 #include <SDL2/SDL.h>
 #endif
@@ -33,6 +35,9 @@ void init_alarm();
 void send_key(uint8_t, bool);
 void vga_update_screen();
 
+// host devices are polled at most every such many guest instructions
+#define DEVICE_POLL_INTERVAL 65536
+
 void device_update() {
   static uint64_t last = 0;
   uint64_t now = get_time();
@@ -66,6 +71,11 @@ void device_update() {
 #endif
 }
 
+static void device_poll() {
+  device_update();
+  event_add(DEVICE_POLL_INTERVAL, device_poll);
+}
+
 void sdl_clear_event_queue() {
 #ifndef CONFIG_TARGET_AM
   SDL_Event event;
@@ -73,17 +83,27 @@ void sdl_clear_event_queue() {
 #endif
 }
 
-void init_device() {
-  IFDEF(CONFIG_TARGET_AM, ioe_init());
+// the devices every guest has, see nemu_ctx_new()
+void init_guest_device() {
   init_map();
 
   IFDEF(CONFIG_HAS_SERIAL, init_serial());
   IFDEF(CONFIG_HAS_TIMER, init_timer());
+  // the alarm fires in the virtual time of each guest
+  IFNDEF(CONFIG_TARGET_AM, IFDEF(CONFIG_ICOUNT, init_alarm()));
+}
+
+void init_device() {
+  IFDEF(CONFIG_TARGET_AM, ioe_init());
+  init_guest_device();
+
+  // the devices on the SDL window and host files, only the first guest has them
   IFDEF(CONFIG_HAS_VGA, init_vga());
   IFDEF(CONFIG_HAS_KEYBOARD, init_i8042());
   IFDEF(CONFIG_HAS_AUDIO, init_audio());
   IFDEF(CONFIG_HAS_DISK, init_disk());
   IFDEF(CONFIG_HAS_SDCARD, init_sdcard());
 
-  IFNDEF(CONFIG_TARGET_AM, init_alarm());
+  IFNDEF(CONFIG_TARGET_AM, IFNDEF(CONFIG_ICOUNT, init_alarm()));
+  event_add(DEVICE_POLL_INTERVAL, device_poll);
 }
@@ -0,0 +1,93 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+#include <device/event.h>
+#include <context.h>
+
+#define heap     (nemu_ctx->events.heap)
+#define nr_event (nemu_ctx->events.nr)
+
+static void swap(int i, int j) {
+  Event t = heap[i];
+  heap[i] = heap[j];
+  heap[j] = t;
+}
+
+void event_add(uint64_t delay, event_handler_t h) {
+  Assert(nr_event < MAX_EVENT, "too many pending events");
+  int i = nr_event ++;
+  heap[i].when = g_nr_guest_inst + delay;
+  heap[i].handler = h;
+  for (; i > 0 && heap[(i - 1) / 2].when > heap[i].when; i = (i - 1) / 2) {
+    swap(i, (i - 1) / 2);
+  }
+  event_deadline = heap[0].when;
+}
+
+static void event_pop() {
+  heap[0] = heap[-- nr_event];
+  int i = 0;
+  while (true) {
+    int l = 2 * i + 1, r = l + 1, min = i;
+    if (l < nr_event && heap[l].when < heap[min].when) min = l;
+    if (r < nr_event && heap[r].when < heap[min].when) min = r;
+    if (min == i) break;
+    swap(i, min);
+    i = min;
+  }
+}
+
+void event_rebase(uint64_t from, uint64_t to) {
+  // the order of the heap is kept
+  for (int i = 0; i < nr_event; i ++) {
+    uint64_t delay = (heap[i].when > from ? heap[i].when - from : 0);
+    heap[i].when = to + delay;
+  }
+  event_deadline = (nr_event > 0 ? heap[0].when : UINT64_MAX);
+}
+
+#ifdef CONFIG_ICOUNT
+#define icount_bias (nemu_ctx->events.icount_bias)
+
+uint64_t icount_get_time() {
+  return (g_nr_guest_inst + icount_bias) / CONFIG_ICOUNT_MHZ;
+}
+
+void icount_skip() {
+  if (nr_event == 0 || heap[0].when <= g_nr_guest_inst) return;
+  uint64_t skip = heap[0].when - g_nr_guest_inst;
+  icount_bias += skip;
+  // the order of the heap is kept
+  for (int i = 0; i < nr_event; i ++) heap[i].when -= skip;
+  event_deadline = heap[0].when;
+}
+
+uint64_t icount_get_bias() {
+  return icount_bias;
+}
+
+void icount_set_bias(uint64_t bias) {
+  icount_bias = bias;
+}
+#endif
+
+void event_run() {
+  while (nr_event > 0 && heap[0].when <= g_nr_guest_inst) {
+    event_handler_t h = heap[0].handler;
+    event_pop();
+    // `h` may add events, including itself again
+    h();
+  }
+  event_deadline = (nr_event > 0 ? heap[0].when : UINT64_MAX);
+}
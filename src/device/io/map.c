@@ -17,11 +17,13 @@
 #include <memory/host.h>
 #include <memory/vaddr.h>
 #include <device/map.h>
+#include <trace.h>
+#include <context.h>
 
 #define IO_SPACE_MAX (32 * 1024 * 1024)
 
-static uint8_t *io_space = NULL;
-static uint8_t *p_space = NULL;
+#define io_space (nemu_ctx->io_space)
+#define p_space  (nemu_ctx->p_space)
 
 uint8_t* new_space(int size) {
   uint8_t *p = p_space;
@@ -32,6 +34,89 @@ uint8_t* new_space(int size) {
   return p;
 }
 
+uint8_t* device_space(size_t *size) {
+  *size = p_space - io_space;
+  return io_space;
+}
+
+static void report_overlap(IOMap *m1, IOMap *m2) {
+  panic("IO region %s@[" FMT_PADDR ", " FMT_PADDR "] is overlapped "
+               "with %s@[" FMT_PADDR ", " FMT_PADDR "]", m1->name, m1->low, m1->high, m2->name, m2->low, m2->high);
+}
+
+// give the bytes [l, h] of page `p` to `map`
+static void io_page_share(IOPage *p, paddr_t l, paddr_t h, IOMap *map) {
+  for (paddr_t a = l; a <= h; a ++) {
+    IOMap **s = &p->sub[a & PAGE_MASK];
+    if (*s != NULL) report_overlap(map, *s);
+    *s = map;
+  }
+}
+
+IOMap* io_space_add(IOSpace *s, const char *name, paddr_t addr,
+    void *space, uint32_t len, io_callback_t callback) {
+  Assert(len > 0 && (uint64_t)addr + len - 1 <= 0xffffffffu, "bad IO region %s", name);
+  IOMap *map = malloc(sizeof(IOMap));
+  assert(map);
+  *map = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
+    .space = space, .callback = callback };
+  // the records of the device tracer only have the address
+  IFDEF(CONFIG_DTRACE, IFDEF(CONFIG_TRACE_BINARY, trace_name(TRACE_DEV_NAME, addr, len, name)));
+
+  for (uint64_t pg = map->low & ~(paddr_t)PAGE_MASK; pg <= map->high; pg += PAGE_SIZE) {
+    IOPage **t = &s->dir[pg >> (PAGE_SHIFT + IO_DIR_SHIFT)];
+    if (*t == NULL) {
+      *t = calloc(1 << IO_DIR_SHIFT, sizeof(IOPage));
+      assert(*t);
+    }
+    IOPage *p = io_page(s, pg);
+    paddr_t l = (map->low > pg ? map->low : pg);
+    paddr_t h = (map->high < pg + PAGE_MASK ? map->high : pg + PAGE_MASK);
+
+    if (p->sub == NULL && p->map == NULL) {
+      p->map = map;
+      if (callback == NULL && l == pg && h == pg + PAGE_MASK) {
+        p->host = (uint8_t *)space + (pg - map->low);
+      }
+      continue;
+    }
+    if (p->sub == NULL) {
+      // the page is shared from now on
+      IOMap *old = p->map;
+      if (old->low <= pg && old->high >= pg + PAGE_MASK) report_overlap(map, old);
+      p->sub = calloc(PAGE_SIZE, sizeof(IOMap *));
+      assert(p->sub);
+      io_page_share(p, (old->low > pg ? old->low : pg),
+          (old->high < pg + PAGE_MASK ? old->high : pg + PAGE_MASK), old);
+      p->map = NULL;
+      p->host = NULL;
+    }
+    io_page_share(p, l, h, map);
+  }
+  return map;
+}
+
+void io_space_free(IOSpace *s) {
+  for (int i = 0; i < IO_NR_DIR; i ++) {
+    IOPage *t = s->dir[i];
+    if (t == NULL) continue;
+    for (int j = 0; j < (1 << IO_DIR_SHIFT); j ++) {
+      IOPage *p = &t[j];
+      paddr_t pg = ((paddr_t)i << (PAGE_SHIFT + IO_DIR_SHIFT)) | ((paddr_t)j << PAGE_SHIFT);
+      // a map is freed at its last byte
+      if (p->map != NULL && p->map->high <= pg + PAGE_MASK) free(p->map);
+      if (p->sub != NULL) {
+        for (int k = 0; k < PAGE_SIZE; k ++) {
+          if (p->sub[k] != NULL && p->sub[k]->high == pg + k) free(p->sub[k]);
+        }
+        free(p->sub);
+      }
+    }
+    free(t);
+    s->dir[i] = NULL;
+  }
+}
+
 static bool check_bound(IOMap *map, paddr_t addr) {
   if (map == NULL) {
     Log("%s address (" FMT_PADDR ") is out of bound at pc = " FMT_WORD, ANSI_FMT("Quit Due to", ANSI_FG_YELLOW), addr, cpu.pc);
@@ -60,8 +145,12 @@ void init_map() {
   p_space = io_space;
 }
 
-void log_device(IOMap *map, bool is_write)
+void log_device(IOMap *map, paddr_t addr, int len, word_t data, bool is_write)
 {
+#ifdef CONFIG_TRACE_BINARY
+  trace_emit(is_write ? TRACE_DEV_WRITE : TRACE_DEV_READ, len, addr, is_write ? data : 0);
+  return;
+#endif
   if (is_write)
   {
     log_write("@@@ write ");
@@ -83,7 +172,7 @@ word_t map_read(paddr_t addr, int len, IOMap *map) {
     return 0;
   }
   paddr_t offset = addr - map->low;
-  IFDEF(CONFIG_DTRACE, log_device(map, false));
+  IFDEF(CONFIG_DTRACE, log_device(map, addr, len, 0, false));
   invoke_callback(map->callback, offset, len, false); // prepare data to read
   word_t ret = host_read(map->space + offset, len);
   return ret;
@@ -97,6 +186,6 @@ void map_write(paddr_t addr, int len, word_t data, IOMap *map) {
   }
   paddr_t offset = addr - map->low;
   host_write(map->space + offset, len, data);
-  IFDEF(CONFIG_DTRACE, log_device(map, true));
+  IFDEF(CONFIG_DTRACE, log_device(map, addr, len, data, true));
   invoke_callback(map->callback, offset, len, true);
 }
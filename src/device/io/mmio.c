@@ -15,15 +15,12 @@
 
 #include <device/map.h>
 #include <memory/paddr.h>
+#include <context.h>
 
-#define NR_MAP 16
-
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+#define mmio (nemu_ctx->mmio)
 
 static IOMap* fetch_mmio_map(paddr_t addr) {
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  return (mapid == -1 ? NULL : &maps[mapid]);
+  return fetch_map(&mmio, addr);
 }
 
 static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
@@ -34,23 +31,19 @@ static void report_mmio_overlap(const char *name1, paddr_t l1, paddr_t r1,
 
 /* device interface */
 void add_mmio_map(const char *name, paddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
   paddr_t left = addr, right = addr + len - 1;
   if (in_pmem(left) || in_pmem(right)) {
     report_mmio_overlap(name, left, right, "pmem", PMEM_LEFT, PMEM_RIGHT);
   }
-  for (int i = 0; i < nr_map; i++) {
-    if (left <= maps[i].high && right >= maps[i].low) {
-      report_mmio_overlap(name, left, right, maps[i].name, maps[i].low, maps[i].high);
-    }
-  }
 
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
-    .space = space, .callback = callback };
+  IOMap *map = io_space_add(&mmio, name, addr, space, len, callback);
   Log("Add mmio map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
+      map->name, map->low, map->high);
+}
 
-  nr_map ++;
+uint8_t* mmio_page_host(paddr_t addr) {
+  IOPage *p = io_page(&mmio, addr);
+  return (p == NULL || p->host == NULL ? NULL : p->host + (addr & PAGE_MASK));
 }
 
 /* bus interface */
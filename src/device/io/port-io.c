@@ -14,36 +14,31 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <context.h>
 
 #define PORT_IO_SPACE_MAX 65535
 
-#define NR_MAP 16
-static IOMap maps[NR_MAP] = {};
-static int nr_map = 0;
+#define pio (nemu_ctx->pio)
 
 /* device interface */
 void add_pio_map(const char *name, ioaddr_t addr, void *space, uint32_t len, io_callback_t callback) {
-  assert(nr_map < NR_MAP);
   assert(addr + len <= PORT_IO_SPACE_MAX);
-  maps[nr_map] = (IOMap){ .name = name, .low = addr, .high = addr + len - 1,
-    .space = space, .callback = callback };
+  IOMap *map = io_space_add(&pio, name, addr, space, len, callback);
   Log("Add port-io map '%s' at [" FMT_PADDR ", " FMT_PADDR "]",
-      maps[nr_map].name, maps[nr_map].low, maps[nr_map].high);
-
-  nr_map ++;
+      map->name, map->low, map->high);
 }
 
 /* CPU interface */
 uint32_t pio_read(ioaddr_t addr, int len) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  return map_read(addr, len, &maps[mapid]);
+  IOMap *map = fetch_map(&pio, addr);
+  assert(map != NULL);
+  return map_read(addr, len, map);
 }
 
 void pio_write(ioaddr_t addr, int len, uint32_t data) {
   assert(addr + len - 1 < PORT_IO_SPACE_MAX);
-  int mapid = find_mapid_by_addr(maps, nr_map, addr);
-  assert(mapid != -1);
-  map_write(addr, len, data, &maps[mapid]);
+  IOMap *map = fetch_map(&pio, addr);
+  assert(map != NULL);
+  map_write(addr, len, data, map);
 }
@@ -15,6 +15,7 @@
 
 #include <device/map.h>
 #include <utils.h>
+#include <context.h>
 
 #define KEYDOWN_MASK 0x8000
 
@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <device/map.h>
+#include <replay.h>
 #include "mmc.h"
 
 // http://www.files.e-shop.co.il/pdastore/Tech-mmc-samsung/SEC%20MMC%20SPEC%20ver09.pdf
@@ -111,8 +112,10 @@ static void sdcard_io_handler(uint32_t offset, int len, bool is_write) {
          if (addr == 512 - 4) read_ext_csd = false;
        } else if (fp) {
          __attribute__((unused)) int ret;
-         if (!write_cmd) { ret = fread(&base[SDDATA], 4, 1, fp); }
-         else { ret = fwrite(&base[SDDATA], 4, 1, fp); }
+         if (write_cmd) { ret = fwrite(&base[SDDATA], 4, 1, fp); }
+         // the image may have been written since the data was read
+         else if (replay_input(&base[SDDATA], 4)) { fseek(fp, 4, SEEK_CUR); }
+         else { ret = fread(&base[SDDATA], 4, 1, fp); record_input(&base[SDDATA], 4); }
        }
        addr += 4;
        break;
@@ -15,16 +15,19 @@
 
 #include <utils.h>
 #include <device/map.h>
+#include <context.h>
+#include <replay.h>
 
 /* http://en.wikibooks.org/wiki/Serial_Programming/8250_UART_Programming */
 // NOTE: this is compatible to 16550
 
 #define CH_OFFSET 0
 
-static uint8_t *serial_base = NULL;
+#define serial_base (nemu_ctx->serial_base)
 
 
 static void serial_putc(char ch) {
+  IFDEF(CONFIG_REPLAY, if (replay_mute) return);
   MUXDEF(CONFIG_TARGET_AM, putch(ch), putc(ch, stderr));
 }
 
@@ -15,14 +15,34 @@
 
 #include <device/map.h>
 #include <device/alarm.h>
+#include <device/event.h>
 #include <utils.h>
+#include <context.h>
+#include <replay.h>
 
-static uint32_t *rtc_port_base = NULL;
+#define rtc_port_base (nemu_ctx->rtc_port_base)
+
+#ifdef CONFIG_ICOUNT_SKIP_IDLE
+// the guest is considered idle after reading the RTC such many times in a
+// row, each within such many instructions after the previous one
+#define RTC_IDLE_POLLS 8
+#define RTC_IDLE_WINDOW 256
+
+static void rtc_check_idle() {
+  uint64_t *last = &nemu_ctx->rtc_last_poll;
+  int *nr_poll = &nemu_ctx->rtc_nr_poll;
+  *nr_poll = (g_nr_guest_inst - *last < RTC_IDLE_WINDOW ? *nr_poll + 1 : 0);
+  *last = g_nr_guest_inst;
+  if (*nr_poll >= RTC_IDLE_POLLS) icount_skip();
+}
+#endif
 
 static void rtc_io_handler(uint32_t offset, int len, bool is_write) {
   assert(offset == 0 || offset == 4);
   if (!is_write && offset == 4) {
-    uint64_t us = get_time();
+    IFDEF(CONFIG_ICOUNT_SKIP_IDLE, rtc_check_idle());
+    // the virtual time is the same in a replay anyway
+    uint64_t us = MUXDEF(CONFIG_ICOUNT, icount_get_time(), REPLAY_INPUT(uint64_t, get_time()));
     rtc_port_base[0] = (uint32_t)us;
     rtc_port_base[1] = us >> 32;
   }
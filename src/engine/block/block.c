@@ -0,0 +1,152 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+
+#define BLOCK_MAX_UOP 64
+#define NR_BLOCK 8192
+#define NR_UOP (NR_BLOCK * 16)
+#define BLOCK_HASH_SIZE 4096
+#define BLOCK_HASH(pc) (((pc) >> 2) & (BLOCK_HASH_SIZE - 1))
+#define NR_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+#define PAGE_IDX(pc) (((pc) - CONFIG_MBASE) >> PAGE_SHIFT)
+
+typedef struct Block {
+  vaddr_t pc;
+  int nr_uop;
+  Uop *uop;
+#ifdef CONFIG_BLOCK_JIT
+  int (*code)(CPU_state *);
+#endif
+  struct Block *hash_next;
+  struct Block *page_next;
+  // successors seen so far, patched in on the first transition to them,
+  // a direct branch has at most two of them
+  vaddr_t next_pc[2];
+  struct Block *next[2];
+} Block;
+
+static Block block_pool[NR_BLOCK];
+static int nr_block = 0;
+static Uop uop_pool[NR_UOP];
+static int nr_uop = 0;
+#ifdef CONFIG_BLOCK_JIT
+bool jit_full(int nr_uop);
+void jit_flush();
+void* jit_compile(const Uop *u, int n);
+#endif
+
+static Block *block_hash[BLOCK_HASH_SIZE] = {};
+static Block *page_block[NR_PAGE] = {};
+// the block executed to its end last time, its successor can be chained
+static Block *last = NULL;
+// set when blocks are flushed, the running block should stop
+bool block_stale = false;
+
+static void block_flush() {
+  memset(block_hash, 0, sizeof(block_hash));
+  memset(page_block, 0, sizeof(page_block));
+  nr_block = 0;
+  nr_uop = 0;
+  last = NULL;
+  IFDEF(CONFIG_BLOCK_JIT, jit_flush());
+}
+
+static Block* block_translate(vaddr_t pc) {
+  Assert(in_pmem(pc), "can not translate block at pc = " FMT_WORD, pc);
+  if (nr_block == NR_BLOCK || nr_uop + BLOCK_MAX_UOP > NR_UOP
+      IFDEF(CONFIG_BLOCK_JIT, || jit_full(BLOCK_MAX_UOP))) {
+    block_flush();
+  }
+
+  Block *b = &block_pool[nr_block ++];
+  b->pc = pc;
+  b->uop = &uop_pool[nr_uop];
+  b->nr_uop = isa_translate_block(pc, b->uop, BLOCK_MAX_UOP);
+  nr_uop += b->nr_uop;
+  IFDEF(CONFIG_BLOCK_JIT, b->code = jit_compile(b->uop, b->nr_uop));
+  b->next_pc[0] = b->next_pc[1] = (vaddr_t)-1;
+  b->next[0] = b->next[1] = NULL;
+
+  b->hash_next = block_hash[BLOCK_HASH(pc)];
+  block_hash[BLOCK_HASH(pc)] = b;
+  b->page_next = page_block[PAGE_IDX(pc)];
+  page_block[PAGE_IDX(pc)] = b;
+  return b;
+}
+
+static Block* block_lookup(vaddr_t pc) {
+  for (Block *b = block_hash[BLOCK_HASH(pc)]; b != NULL; b = b->hash_next) {
+    if (b->pc == pc) return b;
+  }
+  return block_translate(pc);
+}
+
+static Block* block_next(vaddr_t pc) {
+  if (last != NULL) {
+    if (last->next_pc[0] == pc) return last->next[0];
+    if (last->next_pc[1] == pc) return last->next[1];
+  }
+
+  Block *b = block_lookup(pc);
+  // `last` is reset if the lookup flushes all blocks
+  if (last != NULL) {
+    // the second slot is replaced when an indirect jump changes its target
+    int i = (last->next[0] == NULL ? 0 : 1);
+    last->next_pc[i] = pc;
+    last->next[i] = b;
+  }
+  return b;
+}
+
+// called by the memory when a page holding translated blocks is written
+void code_invalidate(paddr_t addr, int len) {
+  for (Block *b = page_block[PAGE_IDX(addr)]; b != NULL; b = b->page_next) {
+    if (addr < b->pc + b->nr_uop * 4 && addr + len > b->pc) {
+      block_flush();
+      block_stale = true;
+      return;
+    }
+  }
+}
+
+/* Execute at most `n` instructions from the block at cpu.pc, stopping
+ * before `stop_pc` if the block runs through it,
+ * return the number of instructions actually executed.
+ */
+uint64_t block_exec(Decode *s, uint64_t n, vaddr_t stop_pc) {
+  Block *b = block_next(cpu.pc);
+  int nr = (n < b->nr_uop ? n : b->nr_uop);
+  if (stop_pc > b->pc && stop_pc < b->pc + nr * 4) nr = (stop_pc - b->pc) / 4;
+  block_stale = false;
+  int nr_exec;
+#ifdef CONFIG_BLOCK_JIT
+  if (nr == b->nr_uop) {
+    nr_exec = b->code(&cpu);
+    s->pc = b->uop[nr_exec - 1].pc;
+    s->dnpc = cpu.pc;
+  } else
+#endif
+  {
+    nr_exec = isa_exec_block(s, b->uop, nr);
+    cpu.pc = s->dnpc;
+  }
+  // only a block run to its end and still alive can be chained
+  last = (nr_exec == b->nr_uop && !block_stale ? b : NULL);
+  return nr_exec;
+}
@@ -0,0 +1,344 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <cpu/cpu.h>
+#include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <stddef.h>
+
+#ifdef CONFIG_BLOCK_JIT
+#ifndef __x86_64__
+#error "CONFIG_BLOCK_JIT only supports x86-64 hosts"
+#endif
+
+#include <sys/mman.h>
+
+/* Each block is compiled into a host function `int f(CPU_state *cpu)`
+ * which returns the number of guest instructions it has executed.
+ * Guest registers stay in `cpu`, so the interpreter can run any uop in
+ * the middle of a block, this is how uops without native code are run.
+ *
+ * pinned host registers (all callee-saved):
+ *   rbx - &cpu
+ *   r12 - host address of guest physical address 0
+ *   rbp - pmem page flags, stores to flagged pages go to the slow path
+ * scratch: rax, rcx, rdx, rsi, rdi
+ */
+
+#define JIT_BUF_SIZE (32 * 1024 * 1024)
+#define JIT_MAX_UOP_BYTES 192
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI };
+
+static uint8_t *jit_buf = NULL;
+static uint8_t *jit_ptr = NULL;
+
+extern bool block_stale;
+int isa_exec_block(struct Decode *s, const struct Uop *u, int n);
+
+/* helpers called by the generated code */
+
+static word_t jit_load(vaddr_t addr, int len) {
+  return vaddr_read(addr, len);
+}
+
+static void jit_store(vaddr_t addr, int len, word_t data) {
+  vaddr_write(addr, len, data);
+}
+
+static void jit_exec_uop(const Uop *u) {
+  Decode s;
+  isa_exec_block(&s, u, 1);
+  cpu.pc = s.dnpc;
+}
+
+/* x86-64 encoding */
+
+static inline void emit1(uint8_t b) { *jit_ptr ++ = b; }
+static inline void emit4(uint32_t v) { memcpy(jit_ptr, &v, 4); jit_ptr += 4; }
+static inline void emit8(uint64_t v) { memcpy(jit_ptr, &v, 8); jit_ptr += 8; }
+
+#define GPR_OFF(i) ((int)offsetof(CPU_state, gpr[0]) + (i) * (int)sizeof(word_t))
+#define PC_OFF ((int)offsetof(CPU_state, pc))
+
+// `op reg, [rbx + disp32]`, `op` may be several bytes
+static void emit_mem(const uint8_t *op, int nr_op, int reg, int disp) {
+  for (int i = 0; i < nr_op; i ++) emit1(op[i]);
+  emit1(0x80 | ((reg & 7) << 3) | RBX);
+  emit4(disp);
+}
+#define EMIT_MEM(reg, disp, ...) do { \
+  const uint8_t __op[] = { __VA_ARGS__ }; \
+  emit_mem(__op, sizeof(__op), reg, disp); \
+} while (0)
+
+static void load_gpr(int reg, int idx) { EMIT_MEM(reg, GPR_OFF(idx), 0x8b); }
+static void store_gpr(int idx, int reg) { if (idx != 0) EMIT_MEM(reg, GPR_OFF(idx), 0x89); }
+static void store_gpr_imm(int idx, word_t imm) {
+  if (idx != 0) { EMIT_MEM(0, GPR_OFF(idx), 0xc7); emit4(imm); }
+}
+static void store_pc_imm(vaddr_t pc) { EMIT_MEM(0, PC_OFF, 0xc7); emit4(pc); }
+
+// `op eax, imm32` with the /digit form of 0x81
+static void alu_eax_imm(int digit, word_t imm) { emit1(0x81); emit1(0xc0 | (digit << 3)); emit4(imm); }
+static void mov_imm(int reg, uint32_t imm) { emit1(0xb8 + reg); emit4(imm); }
+static void mov_imm64(int reg, uint64_t imm) { emit1(0x48); emit1(0xb8 + reg); emit8(imm); }
+static void call(const void *fn) { mov_imm64(RAX, (uintptr_t)fn); emit1(0xff); emit1(0xd0); }
+// setcc al; movzx eax, al
+static void setcc_eax(int cc) { emit1(0x0f); emit1(0x90 | cc); emit1(0xc0); emit1(0x0f); emit1(0xb6); emit1(0xc0); }
+
+static uint8_t* jcc32(int cc) { emit1(0x0f); emit1(0x80 | cc); emit4(0); return jit_ptr; }
+static uint8_t* jmp32() { emit1(0xe9); emit4(0); return jit_ptr; }
+static void patch32(uint8_t *after_jmp) {
+  int32_t rel = jit_ptr - after_jmp;
+  memcpy(after_jmp - 4, &rel, 4);
+}
+
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xc, CC_GE = 0xd };
+
+/* code generation */
+
+// eax = rs1 + imm, edx = eax - MBASE; jump to the returned label if not in pmem
+static uint8_t* emit_addr_check(const Uop *u) {
+  load_gpr(RAX, u->rs1);
+  alu_eax_imm(0, u->imm);
+  emit1(0x89); emit1(0xc2);                   // mov edx, eax
+  emit1(0x81); emit1(0xea); emit4(CONFIG_MBASE); // sub edx, MBASE
+  emit1(0x81); emit1(0xfa); emit4(CONFIG_MSIZE); // cmp edx, MSIZE
+  return jcc32(CC_AE);
+}
+
+static void emit_load(const Uop *u, int len, bool sign) {
+  uint8_t *slow = emit_addr_check(u);
+  // ecx = [r12 + rax]
+  switch (len) {
+    case 1: emit1(0x41); emit1(0x0f); emit1(sign ? 0xbe : 0xb6); break;
+    case 2: emit1(0x41); emit1(0x0f); emit1(sign ? 0xbf : 0xb7); break;
+    case 4: emit1(0x41); emit1(0x8b); break;
+  }
+  emit1(0x0c); emit1(0x04);
+  uint8_t *done = jmp32();
+
+  patch32(slow);
+  emit1(0x89); emit1(0xc7);                   // mov edi, eax
+  mov_imm(RSI, len);
+  call(jit_load);
+  emit1(0x89); emit1(0xc1);                   // mov ecx, eax
+  if (sign && len == 1) { emit1(0x0f); emit1(0xbe); emit1(0xc9); } // movsx ecx, cl
+  if (sign && len == 2) { emit1(0x0f); emit1(0xbf); emit1(0xc9); } // movsx ecx, cx
+
+  patch32(done);
+  store_gpr(u->rd, RCX);
+}
+
+static void emit_store(const Uop *u, int len, int idx, uint8_t **exit) {
+  uint8_t *slow = emit_addr_check(u);
+  // stores to pages holding translated code take the slow path
+  emit1(0x89); emit1(0xd1);                   // mov ecx, edx
+  emit1(0xc1); emit1(0xe9); emit1(PAGE_SHIFT); // shr ecx, PAGE_SHIFT
+  emit1(0x80); emit1(0x7c); emit1(0x0d); emit1(0x00); emit1(0x00); // cmp byte [rbp + rcx], 0
+  uint8_t *code = jcc32(CC_NE);
+  // so do misaligned stores, which may touch the next page
+  uint8_t *misaligned = NULL;
+  if (len > 1) { emit1(0xa8); emit1(len - 1); misaligned = jcc32(CC_NE); } // test al, len - 1
+  load_gpr(RCX, u->rs2);
+  // [r12 + rax] = ecx
+  switch (len) {
+    case 1: emit1(0x41); emit1(0x88); break;
+    case 2: emit1(0x66); emit1(0x41); emit1(0x89); break;
+    case 4: emit1(0x41); emit1(0x89); break;
+  }
+  emit1(0x0c); emit1(0x04);
+  uint8_t *done = jmp32();
+
+  patch32(slow);
+  patch32(code);
+  if (misaligned) patch32(misaligned);
+  emit1(0x89); emit1(0xc7);                   // mov edi, eax
+  mov_imm(RSI, len);
+  load_gpr(RDX, u->rs2);
+  call(jit_store);
+  // the store may overwrite this block, leave it then
+  mov_imm64(RAX, (uintptr_t)&block_stale);
+  emit1(0x80); emit1(0x38); emit1(0x00);      // cmp byte [rax], 0
+  uint8_t *alive = jcc32(CC_E);
+  store_pc_imm(u->pc + 4);
+  mov_imm(RAX, idx + 1);
+  *exit = jmp32();
+
+  patch32(alive);
+  patch32(done);
+}
+
+static void emit_branch(const Uop *u, int cc) {
+  load_gpr(RAX, u->rs1);
+  EMIT_MEM(RAX, GPR_OFF(u->rs2), 0x3b);       // cmp eax, rs2
+  mov_imm(RCX, u->pc + 4);
+  mov_imm(RDX, u->pc + u->imm);
+  emit1(0x0f); emit1(0x40 | cc); emit1(0xca); // cmovcc ecx, edx
+  EMIT_MEM(RCX, PC_OFF, 0x89);
+}
+
+// return false if `u` has no native code
+static bool emit_uop(const Uop *u, int idx, uint8_t **exit) {
+  uint32_t i = u->inst;
+  int f3 = BITS(i, 14, 12), f7 = BITS(i, 31, 25);
+  switch (BITS(i, 6, 0)) {
+    case 0x37: store_gpr_imm(u->rd, u->imm); return true;         // lui
+    case 0x17: store_gpr_imm(u->rd, u->pc + u->imm); return true; // auipc
+    case 0x13: {
+      static const int digit[] = { [0] = 0, [4] = 6, [6] = 1, [7] = 4 };
+      load_gpr(RAX, u->rs1);
+      switch (f3) {
+        case 0: case 4: case 6: case 7: alu_eax_imm(digit[f3], u->imm); break;
+        case 2: alu_eax_imm(7, u->imm); setcc_eax(CC_L); break;  // slti
+        case 3: alu_eax_imm(7, u->imm); setcc_eax(CC_B); break;  // sltiu
+        case 1: case 5: {
+          int shift = (f3 == 1 ? 4 : (f7 == 0 ? 5 : 7));       // shl, shr, sar
+          if ((f7 & ~0x20) != 0 || (f3 == 1 && f7 != 0)) return false;
+          emit1(0xc1); emit1(0xc0 | (shift << 3)); emit1(BITS(u->imm, 4, 0));
+          break;
+        }
+      }
+      store_gpr(u->rd, RAX);
+      return true;
+    }
+    case 0x33: {
+      load_gpr(RAX, u->rs1);
+      if (f7 == 0x00 || (f7 == 0x20 && (f3 == 0 || f3 == 5))) {
+        switch (f3) {
+          case 0: EMIT_MEM(RAX, GPR_OFF(u->rs2), f7 ? 0x2b : 0x03); break; // sub, add
+          case 4: EMIT_MEM(RAX, GPR_OFF(u->rs2), 0x33); break;
+          case 6: EMIT_MEM(RAX, GPR_OFF(u->rs2), 0x0b); break;
+          case 7: EMIT_MEM(RAX, GPR_OFF(u->rs2), 0x23); break;
+          case 2: EMIT_MEM(RAX, GPR_OFF(u->rs2), 0x3b); setcc_eax(CC_L); break;
+          case 3: EMIT_MEM(RAX, GPR_OFF(u->rs2), 0x3b); setcc_eax(CC_B); break;
+          case 1: case 5:
+            load_gpr(RCX, u->rs2);
+            emit1(0xd3); emit1(0xc0 | ((f3 == 1 ? 4 : (f7 ? 7 : 5)) << 3));
+            break;
+        }
+      } else if (f7 == 0x01 && f3 == 0) {
+        EMIT_MEM(RAX, GPR_OFF(u->rs2), 0x0f, 0xaf); // imul eax, rs2
+      } else if (f7 == 0x01 && (f3 == 1 || f3 == 3)) {
+        if (f3 == 1) {
+          EMIT_MEM(RAX, GPR_OFF(u->rs1), 0x48, 0x63); // movsxd rax, rs1
+          EMIT_MEM(RCX, GPR_OFF(u->rs2), 0x48, 0x63); // movsxd rcx, rs2
+        } else {
+          load_gpr(RCX, u->rs2);
+        }
+        emit1(0x48); emit1(0x0f); emit1(0xaf); emit1(0xc1);         // imul rax, rcx
+        emit1(0x48); emit1(0xc1); emit1(f3 == 1 ? 0xf8 : 0xe8); emit1(32); // sar/shr rax, 32
+      } else {
+        return false;
+      }
+      store_gpr(u->rd, RAX);
+      return true;
+    }
+    case 0x03:
+      switch (f3) {
+        case 0: emit_load(u, 1, true); return true;
+        case 1: emit_load(u, 2, true); return true;
+        case 2: emit_load(u, 4, false); return true;
+        case 4: emit_load(u, 1, false); return true;
+        case 5: emit_load(u, 2, false); return true;
+      }
+      return false;
+    case 0x23:
+      if (f3 > 2) return false;
+      emit_store(u, 1 << f3, idx, exit);
+      return true;
+    case 0x63: {
+      static const int cc[] = { CC_E, CC_NE, -1, -1, CC_L, CC_GE, CC_B, CC_AE };
+      if (cc[f3] == -1) return false;
+      emit_branch(u, cc[f3]);
+      return true;
+    }
+    case 0x6f: // jal
+      store_gpr_imm(u->rd, u->pc + 4);
+      store_pc_imm(u->pc + u->imm);
+      return true;
+    case 0x67: // jalr
+      if (f3 != 0) return false;
+      load_gpr(RAX, u->rs1);
+      alu_eax_imm(0, u->imm);
+      emit1(0x83); emit1(0xe0); emit1(0xfe);  // and eax, ~1
+      store_gpr_imm(u->rd, u->pc + 4);
+      EMIT_MEM(RAX, PC_OFF, 0x89);
+      return true;
+  }
+  return false;
+}
+
+bool jit_full(int nr_uop) {
+  return jit_buf != NULL &&
+    jit_ptr + (nr_uop + 2) * JIT_MAX_UOP_BYTES > jit_buf + JIT_BUF_SIZE;
+}
+
+void jit_flush() {
+  jit_ptr = jit_buf;
+}
+
+void* jit_compile(const Uop *u, int n) {
+  if (jit_buf == NULL) {
+    jit_buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    Assert(jit_buf != MAP_FAILED, "can not allocate the JIT code buffer");
+    jit_ptr = jit_buf;
+  }
+
+  uint8_t *entry = jit_ptr;
+  uint8_t *exit[n];
+  int nr_exit = 0;
+  bool native = false;
+
+  // prologue, three pushes keep rsp 16-byte aligned for the helpers
+  emit1(0x53);                                // push rbx
+  emit1(0x55);                                // push rbp
+  emit1(0x41); emit1(0x54);                   // push r12
+  emit1(0x48); emit1(0x89); emit1(0xfb);      // mov rbx, rdi
+  mov_imm64(RBP, (uintptr_t)paddr_page_flags_map());
+  emit1(0x49); emit1(0xbc); emit8((uintptr_t)guest_to_host(CONFIG_MBASE) - CONFIG_MBASE); // mov r12, imm64
+
+  for (int k = 0; k < n; k ++) {
+    uint8_t *start = jit_ptr;
+    uint8_t *e = NULL;
+    native = emit_uop(&u[k], k, &e);
+    if (!native) {
+      jit_ptr = start;
+      mov_imm64(RDI, (uintptr_t)&u[k]);
+      call(jit_exec_uop);
+    }
+    if (e != NULL) exit[nr_exit ++] = e;
+    assert(jit_ptr - start <= JIT_MAX_UOP_BYTES);
+  }
+
+  // a block cut by its length or a page boundary falls through,
+  // the pc is already set if the last uop is run by the interpreter
+  switch (BITS(u[n - 1].inst, 6, 0)) {
+    case 0x63: case 0x6f: case 0x67: break;
+    default: if (native) store_pc_imm(u[n - 1].pc + 4);
+  }
+  mov_imm(RAX, n);
+
+  for (int k = 0; k < nr_exit; k ++) patch32(exit[k]);
+  emit1(0x41); emit1(0x5c);                   // pop r12
+  emit1(0x5d);                                // pop rbp
+  emit1(0x5b);                                // pop rbx
+  emit1(0xc3);                                // ret
+  return entry;
+}
+#endif
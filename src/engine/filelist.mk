@@ -15,3 +15,8 @@
 
 INC_PATH += $(NEMU_HOME)/src/engine/$(ENGINE)
 DIRS-y += src/engine/$(ENGINE)
+
+# engines other than the interpreter share its startup and host call code
+ifndef CONFIG_ENGINE_INTERPRETER
+SRCS-y += src/engine/interpreter/init.c src/engine/interpreter/hostcall.c
+endif
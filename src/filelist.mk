@@ -17,9 +17,19 @@ SRCS-y += src/nemu-main.c
 DIRS-y += src/cpu src/monitor src/utils
 DIRS-$(CONFIG_MODE_SYSTEM) += src/memory
 DIRS-BLACKLIST-$(CONFIG_TARGET_AM) += src/monitor/sdb
+SRCS-BLACKLIST-$(CONFIG_TARGET_AM) += src/monitor/elf-loader.c
+ifndef CONFIG_CHECKPOINT
+SRCS-BLACKLIST-y += src/monitor/sdb/checkpoint.c
+endif
+ifndef CONFIG_REPLAY
+SRCS-BLACKLIST-y += src/monitor/sdb/reverse.c src/utils/replay.c
+endif
 
 SHARE = $(if $(CONFIG_TARGET_SHARE),1,0)
 LIBS += $(if $(CONFIG_TARGET_NATIVE_ELF),-lreadline -ldl -pie,)
+LIBS += $(if $(CONFIG_SNAPSHOT_ZLIB),-lz -lpthread,)
+LIBS += $(if $(CONFIG_TRACE_BINARY),-lpthread,)
+LIBS += $(if $(CONFIG_BTRACE),-lpthread,)
 
 ifdef mainargs
 ASFLAGS += -DBIN_PATH=\"$(mainargs)\"
@@ -15,3 +15,8 @@
 
 INC_PATH += $(NEMU_HOME)/src/isa/$(GUEST_ISA)/include
 DIRS-y += src/isa/$(GUEST_ISA)
+
+# decode trees of the INSTPAT lists, see tools/gen-decode
+INSTPAT_SRC  = src/isa/$(GUEST_ISA)/inst.c
+INSTPAT_TREE = $(BUILD_DIR)/gen/$(GUEST_ISA)/instpat-tree.h
+INC_PATH += $(BUILD_DIR)/gen/$(GUEST_ISA)
@@ -19,8 +19,8 @@
 #include <cpu/decode.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
+#define Mr vaddr_load
+#define Mw vaddr_store
 
 enum {
   TYPE_I, TYPE_U,
@@ -69,6 +69,7 @@ typedef struct {
   word_t mtvec;     // 0x0305
   word_t mepc;      // 0x0341
   word_t mcause;    // 0x0342
+  word_t satp;      // 0x0180
 }csr_t;
 
 typedef struct {
@@ -82,6 +83,11 @@ typedef struct {
   uint32_t inst;
 } MUXDEF(CONFIG_RV64, riscv64_ISADecodeInfo, riscv32_ISADecodeInfo);
 
+#ifdef CONFIG_RV_SV32
+// there is only one privilege level, addresses are translated whenever satp.MODE is Sv32
+#define isa_mmu_check(vaddr, len, type) ((cpu.csr.satp >> 31) ? MMU_TRANSLATE : MMU_DIRECT)
+#else
 #define isa_mmu_check(vaddr, len, type) (MMU_DIRECT)
+#endif
 
 #endif
@@ -26,6 +26,8 @@ static const uint32_t img [] = {
   0xdeadbeef,  // some data
 };
 
+void init_dcache();
+
 static void restart() {
   /* Set the initial program counter. */
   cpu.pc = RESET_VECTOR;
@@ -56,6 +58,8 @@ void init_isa() {
   */
   memcpy(guest_to_host(RESET_VECTOR), img, sizeof(img));
 
+  IFDEF(CONFIG_DCACHE, init_dcache());
+
   /* Initialize this virtual computer system. */
   restart();
 }
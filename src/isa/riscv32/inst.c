@@ -17,10 +17,12 @@
 #include <cpu/cpu.h>
 #include <cpu/ifetch.h>
 #include <cpu/decode.h>
+#include <memory/paddr.h>
+#include <memory/host.h>
 
 #define R(i) gpr(i)
-#define Mr vaddr_read
-#define Mw vaddr_write
+#define Mr vaddr_load
+#define Mw vaddr_store
 
 static word_t* csr_reg(word_t imm) {
   switch (imm) {
@@ -28,12 +30,15 @@ static word_t* csr_reg(word_t imm) {
     case 0x305 :  return &(cpu.csr.mtvec);
     case 0x341 :  return &(cpu.csr.mepc);
     case 0x342 :  return &(cpu.csr.mcause);
+    case 0x180 :  return &(cpu.csr.satp);
     default : panic("not support csr: %u", imm);
   }
   return NULL;
 }
 
 #define CSR(i) *csr_reg(i)
+// a new page table drops all translations
+#define CSR_WRITTEN(i) IFDEF(CONFIG_RV_SV32, if ((i) == 0x180) tlb_flush())
 // void yield() { asm volatile("li a7, -1; ecall");}
 #define ECALL(dnpc) { dnpc = isa_raise_intr(ENVIRONMENT_CALL_FROM_M_MODE, s->pc); }
 
@@ -106,14 +111,158 @@ void ftrace_jump(uint32_t inst_val,  vaddr_t current_pc, vaddr_t next_pc)
     }
 }
 
-static int decode_exec(Decode *s) {
-  s->dnpc = s->snpc;
+#if defined(CONFIG_DCACHE) || defined(CONFIG_ENGINE_BLOCK)
+#define HAS_UOP 1
+
+static inline void uop_fill(Uop *u, Decode *s, const void *handler, int rd, word_t imm, int type) {
+  uint32_t i = s->isa.inst;
+  u->pc = s->pc;
+  u->inst = i;
+  u->rd = rd;
+  u->rs1 = BITS(i, 19, 15);
+  u->rs2 = BITS(i, 24, 20);
+  u->type = type;
+  u->imm = imm;
+  u->handler = handler;
+  paddr_mark_code(s->pc);
+}
+
+// read the source registers the way decode_operand() does for `u->type`,
+// the rs fields of the other types are immediate bits
+static inline void uop_src(const Uop *u, word_t *src1, word_t *src2) {
+  switch (u->type) {
+    case TYPE_S: case TYPE_R: case TYPE_B: *src2 = R(u->rs2); // fall through
+    case TYPE_I: *src1 = R(u->rs1); break;
+    default: break;
+  }
+}
+
+// load the predecoded operands of `u` and jump to its execute body
+#define uop_dispatch(u) do { \
+  s->pc = (u)->pc; \
+  s->snpc = s->pc + 4; \
+  s->dnpc = s->snpc; \
+  s->isa.inst = (u)->inst; \
+  rd = (u)->rd; \
+  uop_src(u, &src1, &src2); \
+  imm = (u)->imm; \
+  goto *((u)->handler); \
+} while (0)
+#endif
+
+#ifdef CONFIG_DCACHE
+// decode cache: a direct-mapped table keyed by pc, each entry keeps the
+// already extracted operands and the address of the execute body (a label
+// inside decode_exec()), so a hit skips both inst_fetch() and the INSTPAT chain
+#define DCACHE_NR_ENTRY (1 << CONFIG_DCACHE_SHIFT)
+#define DCACHE_IDX(pc) (((pc) >> 2) & (DCACHE_NR_ENTRY - 1))
+#define DCACHE_INVALID ((vaddr_t)-1) // never a legal pc since it is not aligned
+
+static Uop dcache[DCACHE_NR_ENTRY];
+
+void init_dcache() {
+  for (int i = 0; i < DCACHE_NR_ENTRY; i ++) {
+    dcache[i].pc = DCACHE_INVALID;
+  }
+}
+
+// called by the memory when a page holding cached instructions is written
+void code_invalidate(paddr_t addr, int len) {
+  // an instruction at `pc` can only live in slot DCACHE_IDX(pc),
+  // so only the words covered by the write need to be checked
+  for (vaddr_t pc = addr & ~(vaddr_t)0x3; pc < addr + len; pc += 4) {
+    Uop *u = &dcache[DCACHE_IDX(pc)];
+    if (u->pc == pc) { u->pc = DCACHE_INVALID; }
+    // the previous instruction may be fused with this one
+    IFDEF(CONFIG_FUSION, u = &dcache[DCACHE_IDX(pc - 4)]; if (u->pc == pc - 4) { u->pc = DCACHE_INVALID; });
+  }
+}
+#endif
+
+#ifdef CONFIG_FUSION
+enum {
+  FUSE_NONE,
+  FUSE_LUI_ADDI,   // lui rd, hi; addi rd2, rd, lo
+  FUSE_AUIPC_JALR, // auipc rd, hi; jalr rd2, lo(rd)
+  FUSE_AUIPC_LW,   // auipc rd, hi; lw rd2, lo(rd)
+  FUSE_SLT_BR,     // slt* rd, ...; beq/bne rd, zero, offset
+  FUSE_SLTU_BR,
+  FUSE_SLTI_BR,
+  FUSE_SLTIU_BR,
+  NR_FUSE
+};
+
+// check if the instruction in `u` and the next one form a pair, fill the
+// operands of the second one: `rd2` is its rd, or 1 for bne and 0 for beq
+static int uop_fuse(Uop *u) {
+  vaddr_t pc2 = u->pc + 4;
+  // the pair is invalidated by code_invalidate() with its first half,
+  // so it should not cross a page or leave pmem
+  if ((pc2 & PAGE_MASK) == 0 || !in_pmem(pc2) || u->rd == 0) return FUSE_NONE;
+  uint32_t i = host_read(guest_to_host(pc2), 4);
+  uint32_t i1 = u->inst;
+  int rs1 = BITS(i, 19, 15), rs2 = BITS(i, 24, 20), f3 = BITS(i, 14, 12);
+  word_t *imm = &u->imm2;
+  u->rd2 = BITS(i, 11, 7);
+  switch (BITS(i1, 6, 0)) {
+    case 0x37:
+      if (BITS(i, 6, 0) == 0x13 && f3 == 0 && rs1 == u->rd) { immI(); return FUSE_LUI_ADDI; }
+      break;
+    case 0x17:
+      if (rs1 != u->rd) break;
+      if (BITS(i, 6, 0) == 0x67 && f3 == 0) { immI(); return FUSE_AUIPC_JALR; }
+      if (BITS(i, 6, 0) == 0x03 && f3 == 2) { immI(); return FUSE_AUIPC_LW; }
+      break;
+    case 0x33: case 0x13:
+      if (BITS(i, 6, 0) != 0x63 || f3 > 1 || rs1 != u->rd || rs2 != 0) break;
+      u->rd2 = f3;
+      immB();
+      switch (BITS(i1, 6, 0) << 8 | BITS(i1, 31, 25) << 3 | BITS(i1, 14, 12)) {
+        case 0x3302: return FUSE_SLT_BR;
+        case 0x3303: return FUSE_SLTU_BR;
+      }
+      switch (BITS(i1, 6, 0) << 8 | BITS(i1, 14, 12)) {
+        case 0x1302: return FUSE_SLTI_BR;
+        case 0x1303: return FUSE_SLTIU_BR;
+      }
+      break;
+  }
+  return FUSE_NONE;
+}
+#endif
+
+#ifdef CONFIG_ENGINE_BLOCK
+extern bool block_stale;
+#endif
+
+// With the decode cache, `u` is the cache slot of s->pc.
+// With the block engine, `u` points to `n` uops to run back to back,
+// or to a single uop to be filled without executing it when `n` is 0.
+static int decode_exec(Decode *s, Uop *u, int n) {
+  int rd = 0;
+  word_t src1 = 0, src2 = 0, imm = 0;
+  int nr_exec = 0;
+#ifdef CONFIG_FUSION
+  static const void *fuse_handler[NR_FUSE] = {
+    [FUSE_NONE] = NULL,
+    [FUSE_LUI_ADDI] = &&__fuse_lui_addi,
+    [FUSE_AUIPC_JALR] = &&__fuse_auipc_jalr,
+    [FUSE_AUIPC_LW] = &&__fuse_auipc_lw,
+    [FUSE_SLT_BR] = &&__fuse_slt_br,
+    [FUSE_SLTU_BR] = &&__fuse_sltu_br,
+    [FUSE_SLTI_BR] = &&__fuse_slti_br,
+    [FUSE_SLTIU_BR] = &&__fuse_sltiu_br,
+  };
+  word_t t = 0;
+#endif
 
 #define INSTPAT_INST(s) ((s)->isa.inst)
 #define INSTPAT_MATCH(s, name, type, ... /* execute body */ ) { \
-  int rd = 0; \
-  word_t src1 = 0, src2 = 0, imm = 0; \
   decode_operand(s, &rd, &src1, &src2, &imm, concat(TYPE_, type)); \
+  IFDEF(HAS_UOP, uop_fill(u, s, &&concat(__exec_, name), rd, imm, concat(TYPE_, type))); \
+  IFDEF(CONFIG_FUSION, u->fused = fuse_handler[uop_fuse(u)]); \
+  IFDEF(CONFIG_ENGINE_BLOCK, if (n == 0) goto *(__instpat_end)); \
+  IFDEF(HAS_UOP, concat(__exec_, name):) \
   __VA_ARGS__ ; \
 }
   // instruction pattern
@@ -125,6 +274,32 @@ static int decode_exec(Decode *s) {
   //    空格是分隔符, 只用于提升模式字符串的可读性, 不参与匹配
   // rd, src1, src2和imm中, 它们分别代表目的操作数的寄存器号码, 两个源操作数和立即数.
   INSTPAT_START();
+#if defined(CONFIG_ENGINE_BLOCK)
+  if (n > 0) {
+    // every execute body ends with `goto *(__instpat_end)`,
+    // redirect it to run the next uop of the block
+    __instpat_end = &&__uop_next;
+    uop_dispatch(u);
+  }
+#elif defined(CONFIG_DCACHE)
+  if (likely(u->pc == s->pc)) {
+#ifdef CONFIG_FUSION
+    if (u->fused != NULL && s->fuse) {
+      nr_exec ++;
+      s->isa.inst = u->inst;
+      s->snpc = s->dnpc = u->pc + 8;
+      rd = u->rd;
+      uop_src(u, &src1, &src2);
+      imm = u->imm;
+      goto *(u->fused);
+    }
+#endif
+    uop_dispatch(u);
+  }
+#endif
+  s->isa.inst = inst_fetch(&s->snpc, 4);
+  s->dnpc = s->snpc;
+
   INSTPAT("0000000 ????? ????? 000 ????? 01100 11", add    , R, R(rd) = src1 + src2);
   INSTPAT("0100000 ????? ????? 000 ????? 01100 11", sub    , R, R(rd) = src1 - src2);
   INSTPAT("0000000 ????? ????? 010 ????? 01100 11", slt    , R, R(rd) = ((sword_t)src1 < (sword_t)src2) ? 1 : 0);
@@ -164,14 +339,15 @@ static int decode_exec(Decode *s) {
   INSTPAT("??????? ????? ????? 001 ????? 00000 11", lh     , I, R(rd) = SEXT(Mr(src1 + imm, 2), 16));
   INSTPAT("??????? ????? ????? 010 ????? 00000 11", lw     , I, R(rd) = SEXT(Mr(src1 + imm, 4), 32));
 
-  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw     , I, if (rd) {R(rd) = CSR(imm);}; CSR(imm) = src1);
-  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs     , I, R(rd) = CSR(imm); CSR(imm) |= src1);
+  INSTPAT("??????? ????? ????? 001 ????? 11100 11", csrrw     , I, if (rd) {R(rd) = CSR(imm);}; CSR(imm) = src1; CSR_WRITTEN(imm));
+  INSTPAT("??????? ????? ????? 010 ????? 11100 11", csrrs     , I, R(rd) = CSR(imm); CSR(imm) |= src1; CSR_WRITTEN(imm));
   // INSTPAT("??????? ????? ????? 011 ????? 11100 11", csrrc     , I, );
   // INSTPAT("??????? ????? ????? 101 ????? 11100 11", csrrwi    , I, );
   // INSTPAT("??????? ????? ????? 110 ????? 11100 11", csrrsi    , I, );
   // INSTPAT("??????? ????? ????? 111 ????? 11100 11", csrrci    , I, );
 
   INSTPAT("0000000 00000 00000 000 00000 11100 11", ecall     , I, ECALL(s->dnpc));
+  INSTPAT("0001001 ????? ????? 000 00000 11100 11", sfence_vma, R, IFDEF(CONFIG_RV_SV32, tlb_flush()));
   INSTPAT("0011000 00010 00000 000 00000 11100 11", mret      , I, s->dnpc = cpu.csr.mepc;
     cpu.csr.mstatus.part.MIE = cpu.csr.mstatus.part.MPIE; cpu.csr.mstatus.part.MPIE = 1; cpu.csr.mstatus.part.MPP = 0;
     );
@@ -194,6 +370,41 @@ static int decode_exec(Decode *s) {
 
   INSTPAT("0000000 00001 00000 000 00000 11100 11", ebreak , N, NEMUTRAP(s->pc, R(10))); // R(10) is $a0
   INSTPAT("??????? ????? ????? ??? ????? ????? ??", inv    , N, INV(s->pc));
+#ifdef CONFIG_FUSION
+  // fused pairs, rd, src1, src2 and imm are the operands of the first half
+__fuse_lui_addi:
+  R(rd) = imm;
+  R(u->rd2) = imm + u->imm2;
+  goto *(__instpat_end);
+__fuse_auipc_jalr:
+  R(rd) = s->pc + imm;
+  s->dnpc = (s->pc + imm + u->imm2) & ~(vaddr_t)1;
+  R(u->rd2) = s->pc + 8;
+  IFDEF(CONFIG_FTRACE, ftrace_jump(host_read(guest_to_host(s->pc + 4), 4), s->pc + 4, s->dnpc));
+  goto *(__instpat_end);
+__fuse_auipc_lw:
+  R(rd) = s->pc + imm;
+  R(u->rd2) = Mr(s->pc + imm + u->imm2, 4);
+  goto *(__instpat_end);
+__fuse_slt_br:   t = (sword_t)src1 < (sword_t)src2; goto __fuse_br;
+__fuse_sltu_br:  t = src1 < src2; goto __fuse_br;
+__fuse_slti_br:  t = (sword_t)src1 < (sword_t)imm; goto __fuse_br;
+__fuse_sltiu_br: t = src1 < imm; goto __fuse_br;
+__fuse_br:
+  R(rd) = t;
+  if (t == u->rd2) { s->dnpc = s->pc + 4 + u->imm2; }
+  goto *(__instpat_end);
+#endif
+#ifdef CONFIG_ENGINE_BLOCK
+__uop_next:
+  R(0) = 0;
+  nr_exec ++;
+  // stop early if the block has just been overwritten by itself
+  if (nr_exec < n && likely(!block_stale)) {
+    u ++;
+    uop_dispatch(u);
+  }
+#endif
   INSTPAT_END();
 
 
@@ -217,10 +428,56 @@ static int decode_exec(Decode *s) {
 
   R(0) = 0; // reset $zero to 0
 
-  return 0;
+  // with the block engine `nr_exec` counts the uops run,
+  // otherwise the second instruction of a fused pair
+  return MUXDEF(CONFIG_ENGINE_BLOCK, nr_exec, nr_exec + 1);
+}
+
+int isa_inst_rd(Decode *s) {
+  uint32_t i = s->isa.inst;
+  switch (BITS(i, 6, 0)) {
+    case 0x23: case 0x63: return 0; // store, branch
+    case 0x73: if (BITS(i, 14, 12) == 0) return 0; // ecall, ebreak, mret
+  }
+  return BITS(i, 11, 7);
 }
 
 int isa_exec_once(Decode *s) {
-  s->isa.inst = inst_fetch(&s->snpc, 4);
-  return decode_exec(s);
+  // the instruction is fetched inside decode_exec() on a decode cache miss
+#if defined(CONFIG_ENGINE_BLOCK)
+  Uop u;
+  decode_exec(s, &u, 0);
+  return decode_exec(s, &u, 1);
+#elif defined(CONFIG_DCACHE)
+  return decode_exec(s, &dcache[DCACHE_IDX(s->pc)], 1);
+#else
+  return decode_exec(s, NULL, 1);
+#endif
+}
+
+#ifdef CONFIG_ENGINE_BLOCK
+static bool is_block_end(const Uop *u) {
+  // branches, jumps, system instructions (including ebreak and CSR
+  // accesses) and invalid instructions all terminate a block
+  switch (BITS(u->inst, 6, 0)) {
+    case 0x63: case 0x6f: case 0x67: case 0x73: return true;
+  }
+  return u->type == TYPE_N;
+}
+
+int isa_translate_block(vaddr_t pc, Uop *u, int max) {
+  Decode s;
+  int n = 0;
+  do {
+    s.pc = s.snpc = pc;
+    decode_exec(&s, &u[n], 0);
+    pc = s.snpc;
+    // a block never crosses a page so that it can be invalidated by page
+  } while (!is_block_end(&u[n ++]) && n < max && (pc & PAGE_MASK) != 0);
+  return n;
+}
+
+int isa_exec_block(Decode *s, const Uop *u, int n) {
+  return decode_exec(s, (Uop *)u, n);
 }
+#endif
@@ -14,12 +14,15 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <trace.h>
 
 extern char* find_record_func_name(vaddr_t next_pc);
 extern int find_record_func_sym(vaddr_t next_pc);
 
 static inline void etrace() {
-#ifdef CONFIG_ETRACE
+#if defined(CONFIG_ETRACE) && defined(CONFIG_TRACE_BINARY)
+  trace_emit(TRACE_EXCP, 0, cpu.csr.mepc, cpu.csr.mcause);
+#elif defined(CONFIG_ETRACE)
   log_write("[ETRACE]: deal exception No: %d", cpu.csr.mcause);
   int index = find_record_func_sym(cpu.csr.mepc);
   if (index == -1) {
@@ -17,6 +17,49 @@
 #include <memory/vaddr.h>
 #include <memory/paddr.h>
 
+#define PTE_V 0x01
+#define PTE_R 0x02
+#define PTE_W 0x04
+#define PTE_X 0x08
+#define PTE_A 0x40
+#define PTE_D 0x80
+
+#define VPN(vaddr, level) (((vaddr) >> (PAGE_SHIFT + 10 * (level))) & 0x3ff)
+#define PTE_PPN(pte) ((paddr_t)((pte) >> 10) << PAGE_SHIFT)
+
+/* Walk the Sv32 page table, return the physical page of `vaddr`
+ * or MEM_RET_FAIL. The A and D bits are set by the walk.
+ */
 paddr_t isa_mmu_translate(vaddr_t vaddr, int len, int type) {
+  paddr_t base = (paddr_t)(cpu.csr.satp & 0x3fffff) << PAGE_SHIFT;
+  for (int level = 1; level >= 0; level --) {
+    paddr_t pte_addr = base + VPN(vaddr, level) * 4;
+    word_t pte = paddr_read(pte_addr, 4);
+    if (!(pte & PTE_V) || ((pte & PTE_W) && !(pte & PTE_R))) return MEM_RET_FAIL;
+    if (!(pte & (PTE_R | PTE_X))) {
+      // pointer to the next level
+      base = PTE_PPN(pte);
+      continue;
+    }
+
+    bool ok = false;
+    switch (type) {
+      case MEM_TYPE_IFETCH: ok = pte & PTE_X; break;
+      case MEM_TYPE_READ:   ok = (pte & PTE_R) || (cpu.csr.mstatus.part.MXR && (pte & PTE_X)); break;
+      case MEM_TYPE_WRITE:  ok = pte & PTE_W; break;
+    }
+    if (!ok) return MEM_RET_FAIL;
+
+    paddr_t pg = PTE_PPN(pte);
+    if (level == 1) {
+      // a misaligned superpage
+      if (pg & (0x3ff << PAGE_SHIFT)) return MEM_RET_FAIL;
+      pg |= VPN(vaddr, 0) << PAGE_SHIFT;
+    }
+
+    word_t new_pte = pte | PTE_A | (type == MEM_TYPE_WRITE ? PTE_D : 0);
+    if (new_pte != pte) paddr_write(pte_addr, 4, new_pte);
+    return pg | MEM_RET_OK;
+  }
   return MEM_RET_FAIL;
 }
@@ -15,14 +15,19 @@
 
 #include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
 #include <device/mmio.h>
 #include <isa.h>
+#include <trace.h>
 
-#if   defined(CONFIG_PMEM_MALLOC)
-static uint8_t *pmem = NULL;
-#else // CONFIG_PMEM_GARRAY
-static uint8_t pmem[CONFIG_MSIZE] PG_ALIGN = {};
+#if   defined(CONFIG_PMEM_GARRAY)
+static uint8_t pmem_array[CONFIG_MSIZE] PG_ALIGN = {};
+#elif defined(CONFIG_PMEM_MMAP)
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
+// the memory of the running guest
+#define pmem (nemu_ctx->pmem)
 
 // x86的物理内存是从0开始编址的, 但对于一些ISA来说却不是这样, 例如mips32和riscv32的物理地址均从0x80000000开始. 因此对于mips32和riscv32, 其CONFIG_MBASE将会被定义成0x80000000. 将来CPU访问内存时, 我们会将CPU将要访问的内存地址映射到pmem中的相应偏移位置, 这是通过nemu/src/memory/paddr.c中的guest_to_host()函数实现的. 例如如果mips32的CPU打算访问内存地址0x80000000, 我们会让它最终访问pmem[0]
 uint8_t* guest_to_host(paddr_t paddr) { return pmem + paddr - CONFIG_MBASE; }
@@ -33,8 +38,85 @@ static word_t pmem_read(paddr_t addr, int len) {
   return ret;
 }
 
+#ifdef CONFIG_PMEM_PAGE_FLAGS
+#define NR_PMEM_PAGE (CONFIG_MSIZE >> PAGE_SHIFT)
+#define page_flags(addr) pmem_page_flags[((addr) - CONFIG_MBASE) >> PAGE_SHIFT]
+
+uint8_t pmem_page_flags[NR_PMEM_PAGE] = {};
+
+uint8_t* paddr_page_flags_map() {
+  return pmem_page_flags;
+}
+
+#ifdef CONFIG_PMEM_DIRTY
+// the last epoch in which each page is written, a new epoch begins with
+// every paddr_dirty_mark(), and the first write to a page in it is recorded
+static uint32_t page_epoch[NR_PMEM_PAGE] = {};
+static uint32_t dirty_epoch = 0;
+
+static void page_dirty(paddr_t addr) {
+  uint8_t *f = &page_flags(addr);
+  if (*f & PAGE_CLEAN) {
+    *f &= ~PAGE_CLEAN;
+    page_epoch[(addr - CONFIG_MBASE) >> PAGE_SHIFT] = dirty_epoch;
+  }
+}
+#endif
+
+static void page_written(paddr_t addr, int len) {
+  IFDEF(CONFIG_PMEM_DIRTY, page_dirty(addr));
+  IFDEF(CONFIG_PMEM_DIRTY, page_dirty(addr + len - 1));
+  IFDEF(CONFIG_TRACK_CODE_PAGE, if ((page_flags(addr) | page_flags(addr + len - 1)) & PAGE_CODE) {
+    code_invalidate(addr, len);
+  });
+}
+#endif
+
+#ifdef CONFIG_TRACK_CODE_PAGE
+void paddr_mark_code(paddr_t addr) {
+  page_flags(addr) |= PAGE_CODE;
+}
+#endif
+
+#ifdef CONFIG_PMEM_DIRTY
+bool paddr_page_dirty(paddr_t addr, uint32_t mark) {
+  return page_epoch[(addr - CONFIG_MBASE) >> PAGE_SHIFT] >= mark;
+}
+
+bool paddr_next_dirty(paddr_t *addr, uint32_t mark) {
+  for (size_t i = (*addr - CONFIG_MBASE) >> PAGE_SHIFT; i < NR_PMEM_PAGE; i ++) {
+    if (page_epoch[i] >= mark) {
+      *addr = CONFIG_MBASE + (i << PAGE_SHIFT);
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t paddr_dirty_mark() {
+  for (size_t i = 0; i < NR_PMEM_PAGE; i ++) pmem_page_flags[i] |= PAGE_CLEAN;
+  // writes hitting the TLB do not check the flags
+  IFDEF(CONFIG_SOFT_TLB, tlb_flush());
+  return ++ dirty_epoch;
+}
+#endif
+
+void paddr_replaced() {
+  IFDEF(CONFIG_SOFT_TLB, tlb_flush());
+#ifdef CONFIG_PMEM_PAGE_FLAGS
+  for (size_t i = 0; i < NR_PMEM_PAGE; i ++) {
+    paddr_t pg = CONFIG_MBASE + (i << PAGE_SHIFT);
+    IFDEF(CONFIG_TRACK_CODE_PAGE, if (pmem_page_flags[i] & PAGE_CODE) code_invalidate(pg, PAGE_SIZE));
+    IFDEF(CONFIG_PMEM_DIRTY, page_dirty(pg));
+  }
+#endif
+}
+
 static void pmem_write(paddr_t addr, int len, word_t data) {
   host_write(guest_to_host(addr), len, data);
+  IFDEF(CONFIG_PMEM_PAGE_FLAGS, if (unlikely(page_flags(addr) | page_flags(addr + len - 1))) {
+    page_written(addr, len);
+  });
 }
 
 static void out_of_bound(paddr_t addr) {
@@ -42,18 +124,71 @@ static void out_of_bound(paddr_t addr) {
       addr, PMEM_LEFT, PMEM_RIGHT, cpu.pc);
 }
 
-void init_mem() {
-#if   defined(CONFIG_PMEM_MALLOC)
-  pmem = malloc(CONFIG_MSIZE);
-  assert(pmem);
+#ifdef CONFIG_PMEM_MMAP
+static void* map_pmem(void *addr, long size, int flags) {
+  void *p = mmap(addr, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | flags, -1, 0);
+  Assert(p != MAP_FAILED, "can not map %#lx bytes for pmem", (unsigned long)size);
+  IFDEF(CONFIG_PMEM_THP, madvise(p, size, MADV_HUGEPAGE));
+  return p;
+}
+#endif
+
+uint8_t* new_pmem() {
+#ifdef CONFIG_PMEM_MMAP
+  uint8_t *p = map_pmem(NULL, CONFIG_MSIZE, 0);
+#else
+  uint8_t *p = malloc(CONFIG_MSIZE);
+  assert(p);
+#endif
+  IFDEF(CONFIG_MEM_RANDOM, memset(p, rand(), CONFIG_MSIZE));
+  return p;
+}
+
+void free_pmem(uint8_t *p) {
+  MUXDEF(CONFIG_PMEM_MMAP, munmap(p, CONFIG_MSIZE), free(p));
+}
+
+void pmem_zero(paddr_t addr, long size) {
+  // sparse memory drops its pages instead of writing them
+  uint8_t *haddr = guest_to_host(addr);
+  MUXDEF(CONFIG_PMEM_MMAP, map_pmem(haddr, size, MAP_FIXED), memset(haddr, 0, size));
+}
+
+void pmem_clear() {
+  pmem_zero(CONFIG_MBASE, CONFIG_MSIZE);
+}
+
+#ifdef CONFIG_PMEM_MAP_IMAGE
+bool pmem_map_file(int fd, long off, paddr_t addr, long size) {
+  long pgsize = sysconf(_SC_PAGESIZE);
+  uint8_t *haddr = guest_to_host(addr);
+  if (size <= 0 || (uintptr_t)haddr % pgsize != 0 || off % pgsize != 0) return false;
+  if (!in_pmem(addr) || size > CONFIG_MSIZE - (addr - CONFIG_MBASE)) return false;
+  void *p = mmap(haddr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, off);
+  Assert(p == haddr, "can not map file to pmem at " FMT_PADDR, addr);
+  // the last page holds the file bytes after the range, e.g. the next
+  // segment of an ELF, or zero beyond the end of file, clear it either way
+  memset(haddr + size, 0, -(uintptr_t)(haddr + size) % pgsize);
+  return true;
+}
 #endif
+
+void init_mem() {
+#ifdef CONFIG_PMEM_GARRAY
+  pmem = pmem_array;
   IFDEF(CONFIG_MEM_RANDOM, memset(pmem, rand(), CONFIG_MSIZE));
+#else
+  pmem = new_pmem();
+#endif
   Log("physical memory area [" FMT_PADDR ", " FMT_PADDR "]", PMEM_LEFT, PMEM_RIGHT);
   Log("pmem: %p %p", &(pmem[0]), pmem);
 }
 
 void memory_trace(paddr_t addr, int len, bool is_read) {
-#ifdef CONFIG_MTRACE
+#if defined(CONFIG_MTRACE) && defined(CONFIG_TRACE_BINARY)
+  trace_emit(is_read ? TRACE_MEM_READ : TRACE_MEM_WRITE, len, addr, 0);
+#elif defined(CONFIG_MTRACE)
   if (is_read)
     log_write("Memory Read  " FMT_PADDR " len: %d\n", addr, len);
   else
@@ -14,8 +14,98 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <memory/host.h>
 #include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <device/map.h>
 
+#ifdef CONFIG_SOFT_TLB
+#define tlb (nemu_ctx->tlb)
+#define TLB_TAG(addr) (((addr) & ~(vaddr_t)PAGE_MASK) | 1)
+
+void tlb_flush() {
+  memset(tlb, 0, sizeof(tlb));
+}
+
+static inline TLBEntry* tlb_entry(vaddr_t addr, int type) {
+  return &tlb[type][(addr >> PAGE_SHIFT) % NR_TLB];
+}
+
+// host memory of a physical page which can be accessed directly, NULL if none
+static uint8_t* tlb_host(paddr_t pg) {
+  if (in_pmem(pg)) return guest_to_host(pg);
+  // device pages without callback, unless difftest needs to see the access
+#if defined(CONFIG_DEVICE) && !defined(CONFIG_DTRACE) && !defined(CONFIG_DIFFTEST)
+  return mmio_page_host(pg);
+#else
+  return NULL;
+#endif
+}
+
+// walk the page table, remember the page if it can be accessed directly
+static paddr_t tlb_fill(vaddr_t addr, int len, int type) {
+  paddr_t pg = isa_mmu_translate(addr, len, type);
+  Assert((pg & PAGE_MASK) == MEM_RET_OK, "page fault at vaddr = " FMT_WORD ", type = %d, pc = " FMT_WORD,
+      addr, type, cpu.pc);
+#ifndef CONFIG_MTRACE
+  uint8_t *host = tlb_host(pg);
+  if (host != NULL) {
+    TLBEntry *e = tlb_entry(addr, type);
+    e->tag = TLB_TAG(addr);
+    e->off = (uintptr_t)host - (addr & ~(vaddr_t)PAGE_MASK);
+  }
+#endif
+  return pg | (addr & PAGE_MASK);
+}
+
+/* The tag of the last byte is compared, so an access crossing the page
+ * misses, since the next page would use the next entry.
+ */
+static word_t tlb_read(vaddr_t addr, int len, int type) {
+  TLBEntry *e = tlb_entry(addr, type);
+  if (likely(e->tag == TLB_TAG(addr + len - 1))) {
+    return host_read((void *)(e->off + addr), len);
+  }
+  if (unlikely((addr & PAGE_MASK) + len > PAGE_SIZE)) {
+    word_t data = 0;
+    for (int i = 0; i < len; i ++) {
+      data |= (word_t)tlb_read(addr + i, 1, type) << (i * 8);
+    }
+    return data;
+  }
+  return paddr_read(tlb_fill(addr, len, type), len);
+}
+
+static void tlb_write(vaddr_t addr, int len, word_t data) {
+  TLBEntry *e = tlb_entry(addr, MEM_TYPE_WRITE);
+  if (likely(e->tag == TLB_TAG(addr + len - 1))) {
+    host_write((void *)(e->off + addr), len, data);
+    return;
+  }
+  if (unlikely((addr & PAGE_MASK) + len > PAGE_SIZE)) {
+    for (int i = 0; i < len; i ++) {
+      tlb_write(addr + i, 1, data >> (i * 8));
+    }
+    return;
+  }
+  paddr_write(tlb_fill(addr, len, MEM_TYPE_WRITE), len, data);
+}
+
+word_t vaddr_ifetch(vaddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_IFETCH) == MMU_DIRECT) return paddr_read(addr, len);
+  return tlb_read(addr, len, MEM_TYPE_IFETCH);
+}
+
+word_t vaddr_read(vaddr_t addr, int len) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_READ) == MMU_DIRECT) return paddr_read(addr, len);
+  return tlb_read(addr, len, MEM_TYPE_READ);
+}
+
+void vaddr_write(vaddr_t addr, int len, word_t data) {
+  if (isa_mmu_check(addr, len, MEM_TYPE_WRITE) == MMU_DIRECT) paddr_write(addr, len, data);
+  else tlb_write(addr, len, data);
+}
+#else
 word_t vaddr_ifetch(vaddr_t addr, int len) {
   return paddr_read(addr, len);
 }
@@ -27,3 +117,4 @@ word_t vaddr_read(vaddr_t addr, int len) {
 void vaddr_write(vaddr_t addr, int len, word_t data) {
   paddr_write(addr, len, data);
 }
+#endif
@@ -0,0 +1,97 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <memory/paddr.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a program header of either ELF class
+typedef struct {
+  uint32_t type;
+  uint64_t offset, paddr, filesz, memsz;
+} Segment;
+
+static Segment get_segment(uint8_t *elf, bool is64, int i) {
+  if (is64) {
+    Elf64_Ehdr *eh = (void *)elf;
+    Elf64_Phdr *ph = (void *)(elf + eh->e_phoff + i * eh->e_phentsize);
+    return (Segment) { ph->p_type, ph->p_offset, ph->p_paddr, ph->p_filesz, ph->p_memsz };
+  }
+  Elf32_Ehdr *eh = (void *)elf;
+  Elf32_Phdr *ph = (void *)(elf + eh->e_phoff + i * eh->e_phentsize);
+  return (Segment) { ph->p_type, ph->p_offset, ph->p_paddr, ph->p_filesz, ph->p_memsz };
+}
+
+static void load_segment(int fd, uint8_t *elf, Segment *s) {
+  Assert(s->paddr >= CONFIG_MBASE && s->paddr - CONFIG_MBASE + s->memsz <= CONFIG_MSIZE,
+      "segment [%#" PRIx64 ", %#" PRIx64 ") is out of bound of pmem", s->paddr, s->paddr + s->memsz);
+  uint8_t *haddr = guest_to_host(s->paddr);
+  bool mapped = false;
+  IFDEF(CONFIG_PMEM_MAP_IMAGE, mapped = pmem_map_file(fd, s->offset, s->paddr, s->filesz));
+  if (!mapped) memcpy(haddr, elf + s->offset, s->filesz);
+
+  uint64_t bss = s->memsz - s->filesz;
+#if defined(CONFIG_PMEM_MMAP) && !defined(CONFIG_MEM_RANDOM)
+  // untouched sparse memory reads as zero, only the rest of the last page
+  // holding the file contents needs to be cleared, which pmem_map_file()
+  // has done for a mapped segment
+  uint64_t pgsize = sysconf(_SC_PAGESIZE);
+  uint64_t tail = -(uintptr_t)(haddr + s->filesz) % pgsize;
+  if (bss > tail) bss = tail;
+  if (mapped) bss = 0;
+#endif
+  memset(haddr + s->filesz, 0, bss);
+}
+
+// Load the PT_LOAD segments of ELF `file` to their physical addresses.
+// Return the size of memory from the reset vector to the end of the last
+// segment, which is copied to the reference of difftest.
+long load_elf(const char *file, vaddr_t *entry) {
+  int fd = open(file, O_RDONLY);
+  Assert(fd >= 0, "Can not open '%s'", file);
+  struct stat st;
+  Assert(fstat(fd, &st) == 0, "Can not stat '%s'", file);
+  uint8_t *elf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  Assert(elf != MAP_FAILED, "Can not map '%s'", file);
+
+  Elf32_Ehdr *eh = (void *)elf;
+  Assert(st.st_size >= sizeof(Elf64_Ehdr) && memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0,
+      "'%s' is not an ELF file", file);
+  Assert(eh->e_ident[EI_DATA] == ELFDATA2LSB, "'%s' is not little-endian", file);
+  bool is64 = eh->e_ident[EI_CLASS] == ELFCLASS64;
+  uint64_t phoff = is64 ? ((Elf64_Ehdr *)elf)->e_phoff : eh->e_phoff;
+  int phnum = is64 ? ((Elf64_Ehdr *)elf)->e_phnum : eh->e_phnum;
+  int phentsize = is64 ? ((Elf64_Ehdr *)elf)->e_phentsize : eh->e_phentsize;
+  Assert(phoff + (uint64_t)phnum * phentsize <= st.st_size, "Bad program headers in '%s'", file);
+
+  paddr_t end = RESET_VECTOR;
+  for (int i = 0; i < phnum; i ++) {
+    Segment s = get_segment(elf, is64, i);
+    if (s.type != PT_LOAD || s.memsz == 0) continue;
+    Assert(s.filesz <= s.memsz && s.offset + s.filesz <= st.st_size, "Bad segment %d in '%s'", i, file);
+    load_segment(fd, elf, &s);
+    Log("Load segment [%#" PRIx64 ", %#" PRIx64 "), file size = %#" PRIx64,
+        s.paddr, s.paddr + s.memsz, s.filesz);
+    if (s.paddr + s.memsz > end) end = s.paddr + s.memsz;
+  }
+  *entry = is64 ? ((Elf64_Ehdr *)elf)->e_entry : eh->e_entry;
+
+  munmap(elf, st.st_size);
+  close(fd);
+  return end - RESET_VECTOR;
+}
@@ -14,6 +14,7 @@
 ***************************************************************************************/
 
 #include <isa.h>
+#include <cpu/cpu.h>
 #include <memory/paddr.h>
 #include <elf-parser.h>
 
@@ -23,7 +24,9 @@ void init_mem();
 void init_difftest(char *ref_so_file, long img_size, int port);
 void init_device();
 void init_sdb();
+void init_replay();
 void init_disasm();
+long load_elf(const char *file, vaddr_t *entry);
 
 static void welcome() {
   Log("Trace: %s", MUXDEF(CONFIG_TRACE, ANSI_FMT("ON", ANSI_FG_GREEN), ANSI_FMT("OFF", ANSI_FG_RED)));
@@ -44,21 +47,41 @@ static char *log_file = NULL;
 static char *diff_so_file = NULL;
 static char *img_file = NULL;
 static char *elf_file = NULL;
+static char *ff_target = NULL;
 static int difftest_port = 1234;
 
-static long load_img() {
-  if (img_file == NULL) {
-    Log("No image is given. Use the default build-in image.");
-    return 4096; // built-in image size
-  }
+static bool is_elf(const char *file) {
+  FILE *fp = fopen(file, "rb");
+  Assert(fp, "Can not open '%s'", file);
+  char magic[SELFMAG];
+  bool ret = (fread(magic, 1, SELFMAG, fp) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0);
+  fclose(fp);
+  return ret;
+}
 
-  FILE *fp = fopen(img_file, "rb");
-  Assert(fp, "Can not open '%s'", img_file);
+long load_img_file(const char *file) {
+  if (is_elf(file)) {
+    vaddr_t entry;
+    long size = load_elf(file, &entry);
+    cpu.pc = entry;
+    Log("The image is ELF %s, entry = " FMT_WORD, file, entry);
+    return size;
+  }
 
+  FILE *fp = fopen(file, "rb");
+  Assert(fp, "Can not open '%s'", file);
   fseek(fp, 0, SEEK_END);
   long size = ftell(fp);
 
-  Log("The image is %s, size = %ld", img_file, size);
+  Log("The image is %s, size = %ld", file, size);
+
+#ifdef CONFIG_PMEM_MAP_IMAGE
+  if (pmem_map_file(fileno(fp), 0, RESET_VECTOR, size)) {
+    Log("The image is mapped copy-on-write");
+    fclose(fp);
+    return size;
+  }
+#endif
 
   fseek(fp, 0, SEEK_SET);
   int ret = fread(guest_to_host(RESET_VECTOR), size, 1, fp);
@@ -68,6 +91,16 @@ static long load_img() {
   return size;
 }
 
+static long load_img() {
+  if (img_file == NULL) img_file = elf_file; // run the ELF given by --elf
+  if (img_file == NULL) {
+    Log("No image is given. Use the default build-in image.");
+    return 4096; // built-in image size
+  }
+  if (elf_file == NULL && is_elf(img_file)) elf_file = img_file; // also take the symbols from it
+  return load_img_file(img_file);
+}
+
 void init_ftrace()
 {
   if (elf_file == NULL) {
@@ -89,7 +122,11 @@ void init_ftrace()
 
   if (is64BitELF(eh))
   {
-    TODO();
+    Log("Symbols of ELF64 are not supported, skip %s", elf_file);
+  }
+  else if (eh.e_shnum == 0)
+  {
+    Log("No section headers in %s, skip the symbols", elf_file);
   }
   else
   {
@@ -110,6 +147,28 @@ void init_ftrace()
   return;
 }
 
+static void init_fast_forward() {
+  if (ff_target == NULL) return;
+
+  char *end;
+  if (ff_target[0] != '@') {
+    uint64_t inst = strtoull(ff_target, &end, 0);
+    Assert(*end == '\0', "Bad instruction count '%s'", ff_target);
+    cpu_fast_forward(false, inst);
+    Log("Fast-forward %" PRIu64 " instructions", inst);
+    return;
+  }
+
+  char *sym = ff_target + 1;
+  vaddr_t pc = strtoull(sym, &end, 0);
+  if (*end != '\0') {
+    IFNDEF(CONFIG_FTRACE, init_ftrace()); // load the symbols
+    Assert(find_record_func_addr(sym, &pc), "Can not find function '%s', give the elf with --elf", sym);
+  }
+  cpu_fast_forward(true, pc);
+  Log("Fast-forward to pc = " FMT_WORD, pc);
+}
+
 static int parse_args(int argc, char *argv[]) {
   const struct option table[] = {
     {"batch"    , no_argument      , NULL, 'b'},
@@ -117,25 +176,28 @@ static int parse_args(int argc, char *argv[]) {
     {"elf"      , required_argument, NULL, 'e'},
     {"diff"     , required_argument, NULL, 'd'},
     {"port"     , required_argument, NULL, 'p'},
+    {"ff"       , required_argument, NULL, 'f'},
     {"help"     , no_argument      , NULL, 'h'},
     {0          , 0                , NULL,  0 },
   };
   int o;
-  while ( (o = getopt_long(argc, argv, "-bhe:l:d:p:", table, NULL)) != -1) {
+  while ( (o = getopt_long(argc, argv, "-bhe:l:d:p:f:", table, NULL)) != -1) {
     switch (o) {
       case 'b': sdb_set_batch_mode(); break;
       case 'p': sscanf(optarg, "%d", &difftest_port); break;
       case 'e': elf_file = optarg; break;
+      case 'f': ff_target = optarg; break;
       case 'l': log_file = optarg; break;
       case 'd': diff_so_file = optarg; break;
       case 1: img_file = optarg; return 0;
       default:
-        printf("Usage: %s [OPTION...] IMAGE [args]\n\n", argv[0]);
+        printf("Usage: %s [OPTION...] IMAGE|ELF [args]\n\n", argv[0]);
         printf("\t-b,--batch              run with batch mode\n");
         printf("\t-l,--log=FILE           output log to FILE\n");
         printf("\t-d,--diff=REF_SO        run DiffTest with reference REF_SO\n");
         printf("\t-p,--port=PORT          run DiffTest with port PORT\n");
-        printf("\t-e,--elf=ELF.           run with EFL file\n");
+        printf("\t-e,--elf=ELF            take symbols from ELF, run it if no IMAGE is given\n");
+        printf("\t-f,--ff=N|@PC|@FUNC     run without tracing up to instruction N or PC/FUNC\n");
         printf("\n");
         exit(0);
     }
@@ -159,6 +221,7 @@ void init_monitor(int argc, char *argv[]) {
   init_mem();
 
   /* Initialize devices. */
+  IFDEF(CONFIG_REPLAY, init_replay());
   IFDEF(CONFIG_DEVICE, init_device());
 
   /* Perform ISA dependent initialization. */
@@ -172,6 +235,9 @@ void init_monitor(int argc, char *argv[]) {
   /* Initialize differential testing. */
   init_difftest(diff_so_file, img_size, difftest_port);
 
+  /* Skip the tracers until the fast-forward target. */
+  init_fast_forward();
+
   /* Initialize the simple debugger. */
   init_sdb();
 
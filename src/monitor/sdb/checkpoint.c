@@ -0,0 +1,164 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <trace.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "sdb.h"
+
+/* A checkpoint is a frozen copy of NEMU made by fork(), the kernel shares
+ * the guest memory of all copies copy-on-write. Taking one forks the
+ * process, the parent freezes as the checkpoint and the child runs on.
+ * Restarting a checkpoint wakes up its process, which forks a new child
+ * to run from there, so the checkpoint can be restarted again later.
+ *
+ * Each checkpoint waits on a pipe whose write ends are held by the
+ * processes after it. Once they all exit, it sees end-of-file and exits
+ * too. The first process of NEMU stays as a supervisor waiting for the
+ * exit status of whichever copy is running, so the shell still sees it.
+ */
+
+typedef struct {
+  int id;
+  pid_t pid;
+  int fd; // write end of the pipe the checkpoint waits on
+  uint64_t nr_inst;
+  vaddr_t pc;
+} Checkpoint;
+
+static Checkpoint ring[CONFIG_CHECKPOINT_NR];
+static int nr_ckpt = 0;
+static int next_id = 1;
+static int status_fd = -1;
+
+static void report_status() {
+  int is_exit_status_bad();
+  int status = is_exit_status_bad();
+  if (write(status_fd, &status, sizeof(status)) != sizeof(status)) return;
+}
+
+// let the first process wait for the exit status, run on in a child
+static bool init_supervisor() {
+  int fd[2];
+  if (pipe(fd) != 0) return false;
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid < 0) { close(fd[0]); close(fd[1]); return false; }
+  if (pid == 0) {
+    close(fd[0]);
+    status_fd = fd[1];
+    atexit(report_status);
+    return true;
+  }
+  close(fd[1]);
+  signal(SIGCHLD, SIG_IGN);
+  // the supervisor does not need the guest memory any more
+  IFDEF(CONFIG_PMEM_MMAP, pmem_clear());
+  int status = 1;
+  ssize_t n;
+  while ((n = read(fd[0], &status, sizeof(status))) < 0 && errno == EINTR);
+  _exit(n == sizeof(status) ? status : 1);
+}
+
+static void drop(int i) {
+  kill(ring[i].pid, SIGKILL);
+  close(ring[i].fd);
+}
+
+// fork a copy to run on and freeze this process as checkpoint `id`,
+// return false in the copy, true in a copy made to restart `id`
+static bool freeze(int id, bool *ok) {
+  bool restart = false;
+  for (;;) {
+    int fd[2];
+    if (pipe(fd) != 0) { *ok = false; return restart; }
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) { close(fd[0]); close(fd[1]); *ok = false; return restart; }
+    if (pid == 0) {
+      close(fd[0]);
+      if (nr_ckpt == CONFIG_CHECKPOINT_NR) {
+        drop(0);
+        memmove(ring, ring + 1, (-- nr_ckpt) * sizeof(ring[0]));
+      }
+      ring[nr_ckpt ++] = (Checkpoint) { .id = id, .pid = getppid(), .fd = fd[1],
+        .nr_inst = g_nr_guest_inst, .pc = cpu.pc };
+      *ok = true;
+      return restart;
+    }
+
+    close(fd[1]);
+    char msg;
+    ssize_t n;
+    while ((n = read(fd[0], &msg, 1)) < 0 && errno == EINTR);
+    close(fd[0]);
+    if (n != 1) _exit(0);
+    // reap the copy which has been running from here
+    while (waitpid(-1, NULL, WNOHANG) > 0);
+    restart = true;
+  }
+}
+
+bool checkpoint_take() {
+  if (status_fd < 0 && !init_supervisor()) {
+    printf("Failed to fork NEMU for checkpoints\n");
+    return false;
+  }
+  int id = next_id ++;
+  bool ok;
+  bool restart = freeze(id, &ok);
+  if (!ok) printf("Failed to take checkpoint %d\n", id);
+  else if (restart) printf("Restart checkpoint %d at pc = " FMT_WORD "\n", id, cpu.pc);
+  else printf("Checkpoint %d at pc = " FMT_WORD ", %" PRIu64 " instructions\n", id, cpu.pc, g_nr_guest_inst);
+  return restart;
+}
+
+void checkpoint_list() {
+  for (int i = 0; i < nr_ckpt; i ++) {
+    printf("%4d  pc = " FMT_WORD "  %" PRIu64 " instructions\n", ring[i].id, ring[i].pc, ring[i].nr_inst);
+  }
+}
+
+// the latest checkpoint taken at or before `nr_inst` instructions
+int checkpoint_before(uint64_t nr_inst) {
+  for (int i = nr_ckpt - 1; i >= 0; i --) {
+    if (ring[i].nr_inst <= nr_inst) return ring[i].id;
+  }
+  return -1;
+}
+
+void checkpoint_drop_all() {
+  for (int i = 0; i < nr_ckpt; i ++) drop(i);
+  nr_ckpt = 0;
+}
+
+void checkpoint_restart(int id) {
+  int i;
+  for (i = nr_ckpt - 1; i >= 0 && ring[i].id != id; i --);
+  if (i < 0) { printf("No checkpoint %d\n", id); return; }
+  // the later checkpoints are lost
+  for (int j = i + 1; j < nr_ckpt; j ++) drop(j);
+  // what has run since is kept in the branch trace before the restarted copy goes on
+  IFDEF(CONFIG_BTRACE, btrace_close());
+  char msg = 'r';
+  if (write(ring[i].fd, &msg, 1) != 1) { printf("Failed to restart checkpoint %d\n", id); return; }
+  // the checkpoint runs on in a new copy, this one leaves quietly
+  fflush(NULL);
+  _exit(0);
+}
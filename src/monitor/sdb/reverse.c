@@ -0,0 +1,154 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <replay.h>
+#include <sys/mman.h>
+#include "sdb.h"
+
+/* Going back runs forward again from a checkpoint: the command leaves a
+ * request in memory shared by all checkpoints and restarts the latest one
+ * before the target, which carries the request out in reverse_resume().
+ * The inputs are replayed from the log, so the run takes the same path.
+ *
+ * `rc` looks for the last change of a watchpoint before the current
+ * instruction: it runs from the checkpoint to here and remembers the last
+ * change on the way, trying the checkpoint before if there is none.
+ */
+
+enum { REV_NONE, REV_GOTO, REV_SEARCH, REV_WATCH };
+
+static struct {
+  int cmd;
+  uint64_t target; // where to go, or where `rc` is typed
+  uint64_t limit;  // REV_SEARCH: where to stop looking
+  // the watchpoints are taken along to the checkpoint
+  int nr_wp;
+  char wp[NR_WP][64];
+} *req = NULL;
+
+extern uint64_t wp_nr_change;
+bool wp_active();
+int wp_save(char exprs[][64], int max);
+void wp_restore(char exprs[][64], int n);
+
+static void go(int id, int cmd, uint64_t target, uint64_t limit) {
+  req->cmd = cmd;
+  req->target = target;
+  req->limit = limit;
+  req->nr_wp = wp_save(req->wp, NR_WP);
+  checkpoint_restart(id);
+  // still here if the checkpoint can not be woken up
+  req->cmd = REV_NONE;
+}
+
+static bool can_replay() {
+  if (replay_log_full()) {
+    printf("The input log is full, the run can not be replayed\n");
+    return false;
+  }
+  return true;
+}
+
+void reverse_step(uint64_t n) {
+  uint64_t target = (n > g_nr_guest_inst ? 0 : g_nr_guest_inst - n);
+  int id = checkpoint_before(target);
+  if (id < 0) { printf("No checkpoint at or before %" PRIu64 " instructions\n", target); return; }
+  if (can_replay()) go(id, REV_GOTO, target, 0);
+}
+
+void reverse_continue() {
+  if (!wp_active()) { printf("No watchpoint\n"); return; }
+  if (g_nr_guest_inst == 0) return;
+  int id = checkpoint_before(g_nr_guest_inst - 1);
+  if (id < 0) { printf("No checkpoint before %" PRIu64 " instructions\n", g_nr_guest_inst); return; }
+  if (can_replay()) go(id, REV_SEARCH, g_nr_guest_inst, g_nr_guest_inst);
+}
+
+void reverse_restart(int id) {
+  go(id, REV_WATCH, 0, 0);
+}
+
+// run to `target` without stopping at watchpoints,
+// return false if restarted from another checkpoint on the way
+static bool run_to(uint64_t target) {
+  wp_restore(NULL, 0);
+  if (target > g_nr_guest_inst && sdb_exec(target - g_nr_guest_inst)) return false;
+  wp_restore(req->wp, req->nr_wp);
+  if (g_nr_guest_inst != target) {
+    printf("Stopped at %" PRIu64 " instructions before reaching %" PRIu64 "\n", g_nr_guest_inst, target);
+  }
+  return true;
+}
+
+// return false if restarted from another checkpoint on the way
+static bool search() {
+  uint64_t start = g_nr_guest_inst;
+  uint64_t hit = 0;
+  bool found = false;
+  wp_restore(req->wp, req->nr_wp);
+  while (g_nr_guest_inst < req->limit && nemu_state.state == NEMU_STOP) {
+    uint64_t nr_change = wp_nr_change;
+    if (sdb_exec(req->limit - g_nr_guest_inst)) return false;
+    // the change at the instruction where `rc` is typed does not count
+    if (wp_nr_change != nr_change && g_nr_guest_inst < req->target) {
+      hit = g_nr_guest_inst;
+      found = true;
+    }
+  }
+
+  int id;
+  if (found) {
+    id = checkpoint_before(hit);
+    go(id, REV_GOTO, hit, 0);
+  } else if (start > 0 && (id = checkpoint_before(start - 1)) >= 0) {
+    go(id, REV_SEARCH, req->target, start);
+  } else {
+    printf("No change of watchpoints found before %" PRIu64 " instructions\n", req->target);
+    if (!run_to(req->target)) return false;
+  }
+  return true;
+}
+
+void reverse_resume() {
+  while (req->cmd != REV_NONE) {
+    int cmd = req->cmd;
+    bool done = true;
+    replay_mute = true;
+    switch (cmd) {
+      case REV_GOTO: done = run_to(req->target); break;
+      case REV_SEARCH: done = search(); break;
+      case REV_WATCH: wp_restore(req->wp, req->nr_wp); break;
+    }
+    // a restart on the way leaves the request of its own
+    if (done) req->cmd = REV_NONE;
+  }
+  if (replay_mute) {
+    replay_mute = false;
+    printf("At pc = " FMT_WORD ", %" PRIu64 " instructions\n", cpu.pc, g_nr_guest_inst);
+  }
+}
+
+// the run takes another path, which the checkpoints are not on
+void reverse_forget() {
+  checkpoint_drop_all();
+  replay_truncate();
+}
+
+void init_reverse() {
+  req = mmap(NULL, sizeof(*req), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  Assert(req != MAP_FAILED, "can not map the request of reverse execution");
+  req->cmd = REV_NONE;
+}
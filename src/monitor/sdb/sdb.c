@@ -26,6 +26,7 @@ static int is_batch_mode = false;
 
 void init_regex();
 void init_wp_pool();
+void init_reverse();
 void show_watch_point();
 bool add_new_expr_wp(char *args_expr);
 bool del_wp_no(int NO);
@@ -48,9 +49,37 @@ static char* rl_gets() {
   return line_read;
 }
 
+#ifdef CONFIG_CHECKPOINT
+static uint64_t ckpt_interval = 0;
+static uint64_t ckpt_next = 0;
+#endif
+
+// run `n` instructions, taking checkpoints on the way if asked to,
+// return true if restarted from an older checkpoint
+bool sdb_exec(uint64_t n) {
+#ifdef CONFIG_CHECKPOINT
+  while (ckpt_interval > 0 && n > 0) {
+    if (g_nr_guest_inst >= ckpt_next) {
+      ckpt_next = g_nr_guest_inst + ckpt_interval;
+      if (checkpoint_take()) return true;
+    }
+    uint64_t step = ckpt_next - g_nr_guest_inst;
+    if (step > n) step = n;
+    uint64_t start = g_nr_guest_inst;
+    cpu_exec(step);
+    // ended, or stopped by a watchpoint
+    if (nemu_state.state != NEMU_STOP || g_nr_guest_inst - start < step) return false;
+    n -= step;
+  }
+  if (n == 0) return false;
+#endif
+  cpu_exec(n);
+  return false;
+}
+
 //  继续运行被暂停的程序
 static int cmd_c(char *args) {
-  cpu_exec(-1);
+  sdb_exec(-1);
   return 0;
 }
 
@@ -71,7 +100,7 @@ static int cmd_si(char *args) {
   }
   // TODO(attention here)
   // NEMU默认会把单步执行的指令打印出来(这里面埋了一些坑, 你需要RTFSC看看指令是在哪里被打印的), 这样你就可以验证单步执行的效果了.
-  cpu_exec(step);
+  sdb_exec(step);
   return 0;
 }
 
@@ -222,6 +251,25 @@ static int cmd_attach(char *args) {
   return 0;
 }
 
+extern bool g_itrace_enable;
+extern THREAD_LOCAL bool g_ftrace_enable;
+static int cmd_trace(char *args) {
+  char *arg_name = strtok(NULL, " ");
+  char *arg_on = strtok(NULL, " ");
+  bool *flag = NULL;
+  if (arg_name == NULL || arg_on == NULL) { flag = NULL; }
+  else if (strcmp(arg_name, "itrace") == 0) { flag = MUXDEF(CONFIG_ITRACE, &g_itrace_enable, NULL); }
+  else if (strcmp(arg_name, "ftrace") == 0) { flag = MUXDEF(CONFIG_FTRACE, &g_ftrace_enable, NULL); }
+  if (flag == NULL || (strcmp(arg_on, "on") != 0 && strcmp(arg_on, "off") != 0))
+  {
+    printf("Usage: trace itrace|ftrace on|off (the tracer must be built in)\n");
+    return 0;
+  }
+  *flag = (strcmp(arg_on, "on") == 0);
+  printf("%s %s\n", arg_name, arg_on);
+  return 0;
+}
+
 void load_user_elf(char* file_name, int file_offset);
 static int cmd_ftrace(char *args) {
   /* extract the first argument */
@@ -251,110 +299,69 @@ static int cmd_ftrace(char *args) {
   return 0;
 }
 
-// 比较暴力的直接把cpu和内存的都给保存下来了
-// TODO未经过测试
+#define SNAPSHOT_FILE "nemu_screenshot"
+
+// save [-i] [-z] [FILE]: -i keeps only the pages written since the last
+// save or load, -z compresses the pages
 static int cmd_save(char *args) {
-  printf("Save current status to file\n");
-  FILE *fptr;
-  fptr = fopen("nemu_screenshot", "wb");
-  
-  if (fptr == NULL) {
-    printf("Failed to open file for writing\n");
-    return 0;
+  bool incremental = false, compress = false;
+  const char *file = SNAPSHOT_FILE;
+  char *arg;
+  while ((arg = strtok(NULL, " ")) != NULL) {
+    if (strcmp(arg, "-i") == 0) incremental = true;
+    else if (strcmp(arg, "-z") == 0) compress = true;
+    else file = arg;
   }
-  
-  // Save CPU state
-  fwrite(&cpu, sizeof(CPU_state), 1, fptr);
-  
-  // Save physical memory by reading it in chunks
-  // We need to read from CONFIG_MBASE to CONFIG_MBASE + CONFIG_MSIZE
-  
-  uint8_t buffer[4096]; // 4KB buffer
-  paddr_t addr = CONFIG_MBASE;
-  size_t remaining = CONFIG_MSIZE;
-  
-  while (remaining > 0) {
-    size_t chunk_size = (remaining < 4096) ? remaining : 4096;
-    
-    // Read memory in chunks
-    for (size_t i = 0; i < chunk_size; i += 4) {
-      if (i + 4 <= chunk_size) {
-        word_t data = paddr_read(addr + i, 4);
-        buffer[i] = data & 0xFF;
-        buffer[i + 1] = (data >> 8) & 0xFF;
-        buffer[i + 2] = (data >> 16) & 0xFF;
-        buffer[i + 3] = (data >> 24) & 0xFF;
-      } else {
-        // Handle remaining bytes
-        for (size_t j = i; j < chunk_size; j++) {
-          buffer[j] = paddr_read(addr + j, 1) & 0xFF;
-        }
-      }
-    }
-    
-    fwrite(buffer, 1, chunk_size, fptr);
-    addr += chunk_size;
-    remaining -= chunk_size;
-  }
-  
-  fclose(fptr);
-  printf("Status saved to nemu_screenshot\n");
+  snapshot_save(file, incremental, compress);
   return 0;
 }
 
-// TODO 如果difftest打开了，需要坐下恢复
 static int cmd_load(char *args) {
-  printf("Load status from file\n");
-  FILE *fptr;
-  fptr = fopen("nemu_screenshot", "rb");
-  
-  if (fptr == NULL) {
-    printf("Failed to open file for reading\n");
-    return 0;
-  }
-  
-  // Load CPU state
-  fread(&cpu, sizeof(CPU_state), 1, fptr);
-  
-  // Load physical memory by writing it in chunks
-  uint8_t buffer[4096]; // 4KB buffer
-  paddr_t addr = CONFIG_MBASE;
-  size_t remaining = CONFIG_MSIZE;
-  
-  while (remaining > 0) {
-    size_t chunk_size = (remaining < 4096) ? remaining : 4096;
-    
-    // Read chunk from file
-    size_t bytes_read = fread(buffer, 1, chunk_size, fptr);
-    if (bytes_read != chunk_size) {
-      printf("Failed to read memory data from file\n");
-      fclose(fptr);
-      return 0;
-    }
-    
-    // Write memory in chunks
-    for (size_t i = 0; i < chunk_size; i += 4) {
-      if (i + 4 <= chunk_size) {
-        word_t data = buffer[i] | (buffer[i + 1] << 8) | 
-                     (buffer[i + 2] << 16) | (buffer[i + 3] << 24);
-        paddr_write(addr + i, 4, data);
-      } else {
-        // Handle remaining bytes
-        for (size_t j = i; j < chunk_size; j++) {
-          paddr_write(addr + j, 1, buffer[j]);
-        }
-      }
-    }
-    
-    addr += chunk_size;
-    remaining -= chunk_size;
+  char *arg = strtok(NULL, " ");
+  snapshot_load(arg == NULL ? SNAPSHOT_FILE : arg);
+  return 0;
+}
+
+#ifdef CONFIG_CHECKPOINT
+// checkpoint [list | every N]: take a checkpoint now, list them, or take
+// one every N instructions while running (0 to stop)
+static int cmd_checkpoint(char *args) {
+  char *arg = strtok(NULL, " ");
+  if (arg == NULL) checkpoint_take();
+  else if (strcmp(arg, "list") == 0) checkpoint_list();
+  else if (strcmp(arg, "every") == 0) {
+    char *n = strtok(NULL, " ");
+    if (n == NULL) { printf("Please give the number of instructions\n"); return 0; }
+    ckpt_interval = strtoull(n, NULL, 0);
+    ckpt_next = g_nr_guest_inst;
   }
-  
-  fclose(fptr);
-  printf("Status loaded from nemu_screenshot\n");
+  else printf("Unknown command '%s'\n", arg);
+  return 0;
+}
+
+static int cmd_restart(char *args) {
+  char *arg = strtok(NULL, " ");
+  if (arg == NULL) { printf("Please give the checkpoint\n"); return 0; }
+  MUXDEF(CONFIG_REPLAY, reverse_restart, checkpoint_restart)(atoi(arg));
+  return 0;
+}
+#endif
+
+#ifdef CONFIG_REPLAY
+// rsi [N]: go back N instructions, 1 by default
+static int cmd_rsi(char *args) {
+  char *arg = strtok(NULL, " ");
+  reverse_step(arg == NULL ? 1 : strtoull(arg, NULL, 0));
   return 0;
 }
 
+// go back to the last change of a watchpoint
+static int cmd_rc(char *args) {
+  reverse_continue();
+  return 0;
+}
+#endif
+
 static int cmd_help(char *args);
 
 static struct {
@@ -373,8 +380,17 @@ static struct {
   { "d", "Delte Watch Point", cmd_d },
   { "detach", "quit Diff Test", cmd_detach },
   { "attach", "open Diff Test", cmd_attach },
-  { "save", "save current status", cmd_save },
-  { "load", "load save status", cmd_load },
+  { "trace", "Switch a tracer on or off: trace itrace|ftrace on|off", cmd_trace },
+  { "save", "Save a snapshot: save [-i] [-z] [FILE]", cmd_save },
+  { "load", "Load a snapshot: load [FILE]", cmd_load },
+#ifdef CONFIG_CHECKPOINT
+  { "checkpoint", "Take a checkpoint: checkpoint [list | every N]", cmd_checkpoint },
+  { "restart", "Go back to a checkpoint: restart ID", cmd_restart },
+#endif
+#ifdef CONFIG_REPLAY
+  { "rsi", "Step back N instructions: rsi [N]", cmd_rsi },
+  { "rc", "Continue back to the last change of a watchpoint", cmd_rc },
+#endif
   { "ft", "load user function elf", cmd_ftrace },
 };
 
@@ -437,6 +453,8 @@ void sdb_mainloop() {
     for (i = 0; i < NR_CMD; i ++) {
       if (strcmp(cmd, cmd_table[i].name) == 0) {
         if (cmd_table[i].handler(args) < 0) { return; }
+        // this may be a checkpoint restarted to go back
+        IFDEF(CONFIG_REPLAY, reverse_resume());
         break;
       }
     }
@@ -451,4 +469,6 @@ void init_sdb() {
 
   /* Initialize the watchpoint pool. */
   init_wp_pool();
+
+  IFDEF(CONFIG_REPLAY, init_reverse());
 }
@@ -18,6 +18,25 @@
 
 #include <common.h>
 
+#define NR_WP 32
+
 word_t expr(char *e, bool *success);
 
+bool snapshot_save(const char *file, bool incremental, bool compress);
+bool snapshot_load(const char *file);
+
+bool checkpoint_take();
+void checkpoint_list();
+void checkpoint_restart(int id);
+int checkpoint_before(uint64_t nr_inst);
+void checkpoint_drop_all();
+
+bool sdb_exec(uint64_t n);
+
+void reverse_step(uint64_t n);
+void reverse_continue();
+void reverse_restart(int id);
+void reverse_resume();
+void reverse_forget();
+
 #endif
@@ -0,0 +1,416 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <isa.h>
+#include <memory/paddr.h>
+#include <memory/vaddr.h>
+#include <device/map.h>
+#include <device/event.h>
+#include <cpu/difftest.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef CONFIG_SNAPSHOT_ZLIB
+#include <pthread.h>
+#include <zlib.h>
+#endif
+#include "sdb.h"
+
+/* A snapshot file is laid out as
+ *
+ *   header | section table | CPU | devices | page runs | page data
+ *
+ * The page data is described by runs of guest pages. Raw runs start at
+ * page aligned offsets, they are restored by mapping the file copy-on-write
+ * and read only when the guest touches them. Zlib runs are inflated at
+ * once. Pages missing from a full snapshot are zero. An incremental
+ * snapshot only holds the pages written after its parent was saved or
+ * loaded, and its parent is loaded before it.
+ */
+
+#define SNAP_MAGIC "NEMUSNAP"
+#define SNAP_VERSION 2
+#define SNAP_MAX_DEPTH 64
+#define RUN_MAX_PAGE 64
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t nr_section;
+  char isa[16];
+  uint64_t mbase, msize, page_size;
+  uint64_t id, parent_id;
+  uint64_t nr_guest_inst, icount_bias;
+  char parent[256];
+} SnapHeader;
+
+enum { SNAP_CPU, SNAP_DEVICE, SNAP_PAGE, NR_SNAP_SECTION };
+
+typedef struct {
+  uint32_t type, pad;
+  uint64_t offset, size;
+} SnapSection;
+
+enum { RUN_ZERO, RUN_RAW, RUN_ZLIB };
+
+typedef struct {
+  uint64_t addr, offset, size;
+  uint32_t nr_page, type;
+} SnapRun;
+
+// the last snapshot saved or loaded, the parent of an incremental one
+static struct {
+  uint64_t id;
+  char file[256];
+#ifdef CONFIG_PMEM_DIRTY
+  uint32_t mark;
+#endif
+} last = {};
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+
+static uint8_t* snap_device_space(size_t *size) {
+#ifdef CONFIG_DEVICE
+  return device_space(size);
+#else
+  *size = 0;
+  return NULL;
+#endif
+}
+
+/* save */
+
+static SnapRun *run = NULL;
+static uint8_t **run_buf = NULL;
+static int nr_run = 0, max_run = 0;
+
+static void add_run(paddr_t addr, int type) {
+  if (nr_run > 0) {
+    SnapRun *r = &run[nr_run - 1];
+    if (r->type == type && r->addr + r->nr_page * PAGE_SIZE == addr &&
+        (type == RUN_ZERO || r->nr_page < RUN_MAX_PAGE)) {
+      r->nr_page ++;
+      return;
+    }
+  }
+  if (nr_run == max_run) {
+    max_run = (max_run == 0 ? 256 : max_run * 2);
+    run = realloc(run, max_run * sizeof(*run));
+    run_buf = realloc(run_buf, max_run * sizeof(*run_buf));
+    assert(run && run_buf);
+  }
+  run[nr_run] = (SnapRun) { .addr = addr, .nr_page = 1, .type = type };
+  run_buf[nr_run] = NULL;
+  nr_run ++;
+}
+
+static bool page_is_zero(paddr_t addr) {
+  uint64_t *p = (uint64_t *)guest_to_host(addr);
+  for (int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i ++) {
+    if (p[i] != 0) return false;
+  }
+  return true;
+}
+
+// a full snapshot leaves out zero pages, an incremental one keeps them
+// to overwrite the pages of its parent
+static void collect_pages(bool incremental) {
+  nr_run = 0;
+  for (uint64_t off = 0; off < CONFIG_MSIZE; off += PAGE_SIZE) {
+    paddr_t addr = CONFIG_MBASE + off;
+#ifdef CONFIG_PMEM_DIRTY
+    if (incremental) {
+      if (!paddr_next_dirty(&addr, last.mark)) break;
+      off = addr - CONFIG_MBASE;
+    }
+#endif
+    bool zero = page_is_zero(addr);
+    if (!zero) add_run(addr, RUN_RAW);
+    else if (incremental) add_run(addr, RUN_ZERO);
+  }
+}
+
+#ifdef CONFIG_SNAPSHOT_ZLIB
+static int next_run = 0;
+
+static void* compress_worker(void *arg) {
+  int i;
+  while ((i = __atomic_fetch_add(&next_run, 1, __ATOMIC_RELAXED)) < nr_run) {
+    SnapRun *r = &run[i];
+    if (r->type != RUN_RAW) continue;
+    uLong len = r->nr_page * PAGE_SIZE;
+    uLongf size = compressBound(len);
+    uint8_t *buf = malloc(size);
+    assert(buf);
+    if (compress2(buf, &size, guest_to_host(r->addr), len, Z_BEST_SPEED) == Z_OK && size < len) {
+      r->type = RUN_ZLIB;
+      r->size = size;
+      run_buf[i] = buf;
+    } else {
+      free(buf);
+    }
+  }
+  return NULL;
+}
+
+static void compress_runs() {
+  int nr_thread = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nr_thread < 1) nr_thread = 1;
+  if (nr_thread > 16) nr_thread = 16;
+  pthread_t t[nr_thread];
+  next_run = 0;
+  for (int i = 0; i < nr_thread; i ++) pthread_create(&t[i], NULL, compress_worker, NULL);
+  for (int i = 0; i < nr_thread; i ++) pthread_join(t[i], NULL);
+}
+#endif
+
+static bool write_at(int fd, const void *buf, uint64_t size, uint64_t off) {
+  while (size > 0) {
+    ssize_t n = pwrite(fd, buf, size, off);
+    if (n <= 0) return false;
+    buf = (const uint8_t *)buf + n;
+    size -= n;
+    off += n;
+  }
+  return true;
+}
+
+static bool same_file(const char *a, const char *b) {
+  struct stat sa, sb;
+  return stat(a, &sa) == 0 && stat(b, &sb) == 0 && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+}
+
+bool snapshot_save(const char *file, bool incremental, bool compress) {
+  if (strlen(file) >= sizeof(last.file)) { printf("File name '%s' is too long\n", file); return false; }
+#ifdef CONFIG_PMEM_DIRTY
+  incremental = incremental && last.id != 0;
+#else
+  incremental = false;
+#endif
+  if (incremental && same_file(file, last.file)) {
+    printf("Can not save an incremental snapshot over its parent '%s'\n", last.file);
+    return false;
+  }
+#ifndef CONFIG_SNAPSHOT_ZLIB
+  if (compress) { printf("Compression is not supported, enable SNAPSHOT_ZLIB\n"); compress = false; }
+#endif
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  SnapHeader h = { .magic = SNAP_MAGIC, .version = SNAP_VERSION, .nr_section = NR_SNAP_SECTION,
+    .isa = str(__GUEST_ISA__), .mbase = CONFIG_MBASE, .msize = CONFIG_MSIZE, .page_size = PAGE_SIZE,
+    .id = (now.tv_sec * 1000000000ull + now.tv_nsec) ^ ((uint64_t)getpid() << 48),
+    .nr_guest_inst = g_nr_guest_inst, .icount_bias = MUXDEF(CONFIG_ICOUNT, icount_get_bias(), 0) };
+  if (incremental) {
+    h.parent_id = last.id;
+    strcpy(h.parent, last.file);
+  }
+
+  collect_pages(incremental);
+  IFDEF(CONFIG_SNAPSHOT_ZLIB, if (compress) compress_runs());
+
+  size_t dev_size;
+  uint8_t *dev = snap_device_space(&dev_size);
+  SnapSection sec[NR_SNAP_SECTION];
+  uint64_t off = sizeof(h) + sizeof(sec);
+  sec[SNAP_CPU] = (SnapSection) { .type = SNAP_CPU, .offset = off, .size = sizeof(cpu) };
+  off = ALIGN_UP(off + sizeof(cpu), 8);
+  sec[SNAP_DEVICE] = (SnapSection) { .type = SNAP_DEVICE, .offset = off, .size = dev_size };
+  off = ALIGN_UP(off + dev_size, 8);
+  sec[SNAP_PAGE] = (SnapSection) { .type = SNAP_PAGE, .offset = off, .size = nr_run * sizeof(SnapRun) };
+  off = ALIGN_UP(off + nr_run * sizeof(SnapRun), PAGE_SIZE);
+  // raw runs first, so they all stay page aligned
+  for (int i = 0; i < nr_run; i ++) {
+    if (run[i].type != RUN_RAW) continue;
+    run[i].offset = off;
+    run[i].size = run[i].nr_page * PAGE_SIZE;
+    off += run[i].size;
+  }
+  for (int i = 0; i < nr_run; i ++) {
+    if (run[i].type != RUN_ZLIB) continue;
+    run[i].offset = off;
+    off += run[i].size;
+  }
+
+  // write to a new file, the old one may still be mapped by the guest
+  char tmp[sizeof(last.file) + 8];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  bool ok = (fd >= 0);
+  ok = ok && write_at(fd, &h, sizeof(h), 0);
+  ok = ok && write_at(fd, sec, sizeof(sec), sizeof(h));
+  ok = ok && write_at(fd, &cpu, sizeof(cpu), sec[SNAP_CPU].offset);
+  ok = ok && write_at(fd, dev, dev_size, sec[SNAP_DEVICE].offset);
+  ok = ok && write_at(fd, run, nr_run * sizeof(SnapRun), sec[SNAP_PAGE].offset);
+  uint64_t nr_page = 0;
+  for (int i = 0; i < nr_run; i ++) {
+    if (run[i].type == RUN_ZERO) continue;
+    nr_page += run[i].nr_page;
+    const void *data = (run[i].type == RUN_RAW ? guest_to_host(run[i].addr) : run_buf[i]);
+    ok = ok && write_at(fd, data, run[i].size, run[i].offset);
+    free(run_buf[i]);
+    run_buf[i] = NULL;
+  }
+  ok = ok && ftruncate(fd, off) == 0;
+  if (fd >= 0) close(fd);
+  ok = ok && rename(tmp, file) == 0;
+  if (!ok) {
+    printf("Failed to write snapshot '%s'\n", file);
+    unlink(tmp);
+    return false;
+  }
+
+  last.id = h.id;
+  strcpy(last.file, file);
+  IFDEF(CONFIG_PMEM_DIRTY, last.mark = paddr_dirty_mark());
+  printf("Save %s snapshot '%s': %" PRIu64 " pages in %d runs, %" PRIu64 " bytes\n",
+      incremental ? "incremental" : "full", file, nr_page, nr_run, off);
+  return true;
+}
+
+/* load */
+
+static const SnapSection* find_section(const uint8_t *p, uint64_t size, int type) {
+  const SnapHeader *h = (const void *)p;
+  const SnapSection *sec = (const void *)(p + sizeof(*h));
+  if (sizeof(*h) + (uint64_t)h->nr_section * sizeof(*sec) > size) return NULL;
+  for (int i = 0; i < h->nr_section; i ++) {
+    if (sec[i].type == type) return (sec[i].offset + sec[i].size <= size ? &sec[i] : NULL);
+  }
+  return NULL;
+}
+
+static bool check_run(const SnapRun *r, uint64_t size) {
+  uint64_t len = (uint64_t)r->nr_page * PAGE_SIZE;
+  if (r->addr < CONFIG_MBASE || r->addr - CONFIG_MBASE + len > CONFIG_MSIZE) return false;
+  switch (r->type) {
+    case RUN_ZERO: return true;
+    case RUN_RAW: return r->size == len && r->offset + len <= size;
+    case RUN_ZLIB: return MUXDEF(CONFIG_SNAPSHOT_ZLIB, r->offset + r->size <= size, false);
+    default: return false;
+  }
+}
+
+// check the whole file before touching the guest, return the header
+static const SnapHeader* check_snapshot(const char *file, const uint8_t *p, uint64_t size) {
+  const SnapHeader *h = (const void *)p;
+#define check(cond, ...) do { if (!(cond)) { printf("Bad snapshot '%s': ", file); printf(__VA_ARGS__); printf("\n"); return NULL; } } while (0)
+  check(size >= sizeof(*h) && memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) == 0, "not a snapshot");
+  check(h->version == SNAP_VERSION, "version %d is not supported", h->version);
+  check(strncmp(h->isa, str(__GUEST_ISA__), sizeof(h->isa)) == 0 && h->mbase == CONFIG_MBASE &&
+      h->msize == CONFIG_MSIZE && h->page_size == PAGE_SIZE, "taken by a different machine");
+  check(memchr(h->parent, '\0', sizeof(h->parent)) != NULL, "bad parent");
+  const SnapSection *s = find_section(p, size, SNAP_CPU);
+  check(s != NULL && s->size == sizeof(cpu), "bad CPU state");
+  size_t dev_size;
+  snap_device_space(&dev_size);
+  s = find_section(p, size, SNAP_DEVICE);
+  check(s != NULL && s->size == dev_size, "bad device state");
+  s = find_section(p, size, SNAP_PAGE);
+  check(s != NULL && s->size % sizeof(SnapRun) == 0, "bad page list");
+  const SnapRun *r = (const void *)(p + s->offset);
+  for (int i = 0; i < s->size / sizeof(SnapRun); i ++) {
+    check(check_run(&r[i], size), "bad page run %d", i);
+  }
+#undef check
+  return h;
+}
+
+static bool load_pages(const char *file, int fd, const uint8_t *p, const SnapSection *s) {
+  const SnapRun *r = (const void *)(p + s->offset);
+  for (int i = 0; i < s->size / sizeof(SnapRun); i ++) {
+    uint8_t *host = guest_to_host(r[i].addr);
+    uint64_t len = (uint64_t)r[i].nr_page * PAGE_SIZE;
+    switch (r[i].type) {
+      case RUN_ZERO: pmem_zero(r[i].addr, len); break;
+      case RUN_RAW: {
+        bool mapped = false;
+        IFDEF(CONFIG_PMEM_MAP_IMAGE, mapped = pmem_map_file(fd, r[i].offset, r[i].addr, len));
+        if (!mapped) memcpy(host, p + r[i].offset, len);
+        break;
+      }
+#ifdef CONFIG_SNAPSHOT_ZLIB
+      case RUN_ZLIB: {
+        uLongf size = len;
+        if (uncompress(host, &size, p + r[i].offset, r[i].size) != Z_OK || size != len) {
+          printf("Bad snapshot '%s': can not inflate page run %d\n", file, i);
+          return false;
+        }
+        break;
+      }
+#endif
+    }
+  }
+  return true;
+}
+
+// load `file` over its parents, return the id of it, 0 on failure
+static uint64_t load_file(const char *file, int depth) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) { printf("Failed to open snapshot '%s'\n", file); return 0; }
+  struct stat st;
+  uint8_t *p = (fstat(fd, &st) == 0 && st.st_size > 0 ?
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+  const SnapHeader *h = (p == MAP_FAILED ? NULL : check_snapshot(file, p, st.st_size));
+  uint64_t id = 0;
+  if (h == NULL) goto out;
+
+  if (h->parent[0] != '\0') {
+    if (depth >= SNAP_MAX_DEPTH) { printf("Too many parents of snapshot '%s'\n", file); goto out; }
+    uint64_t parent_id = load_file(h->parent, depth + 1);
+    if (parent_id == 0) goto out;
+    if (parent_id != h->parent_id) {
+      printf("Parent '%s' of snapshot '%s' has been overwritten\n", h->parent, file);
+      goto out;
+    }
+  } else {
+    pmem_clear();
+  }
+
+  memcpy(&cpu, p + find_section(p, st.st_size, SNAP_CPU)->offset, sizeof(cpu));
+  const SnapSection *s = find_section(p, st.st_size, SNAP_DEVICE);
+  size_t dev_size;
+  uint8_t *dev = snap_device_space(&dev_size);
+  memcpy(dev, p + s->offset, dev_size);
+  if (!load_pages(file, fd, p, find_section(p, st.st_size, SNAP_PAGE))) goto out;
+  IFDEF(CONFIG_DEVICE, event_rebase(g_nr_guest_inst, h->nr_guest_inst));
+  g_nr_guest_inst = h->nr_guest_inst;
+  IFDEF(CONFIG_ICOUNT, icount_set_bias(h->icount_bias));
+  id = h->id;
+
+out:
+  if (p != MAP_FAILED) munmap(p, st.st_size);
+  close(fd);
+  return id;
+}
+
+bool snapshot_load(const char *file) {
+  if (strlen(file) >= sizeof(last.file)) { printf("File name '%s' is too long\n", file); return false; }
+  uint64_t id = load_file(file, 0);
+  // even a failed load may have changed the memory
+  paddr_replaced();
+  IFDEF(CONFIG_REPLAY, reverse_forget());
+  if (id == 0) return false;
+
+  last.id = id;
+  strcpy(last.file, file);
+  IFDEF(CONFIG_PMEM_DIRTY, last.mark = paddr_dirty_mark());
+  nemu_state.state = NEMU_STOP;
+  IFDEF(CONFIG_DIFFTEST, if (difftest_is_on()) difftest_attach());
+  printf("Load snapshot '%s' at pc = " FMT_WORD "\n", file, cpu.pc);
+  return true;
+}
@@ -13,10 +13,9 @@
 * See the Mulan PSL v2 for more details.
 ***************************************************************************************/
 
+#include <context.h>
 #include "sdb.h"
 
-#define NR_WP 32
-
 typedef struct watchpoint {
   int NO;
   char expr[64];
@@ -24,10 +23,16 @@ typedef struct watchpoint {
   struct watchpoint *next;
 } WP;
 
-static WP wp_pool[NR_WP] = {};
-static size_t free_wp_size = NR_WP;
+// only the thread running sdb sets up its pool
+static THREAD_LOCAL WP wp_pool[NR_WP] = {};
+static THREAD_LOCAL size_t free_wp_size = NR_WP;
 // head用于组织使用中的监视点结构, free_用于组织空闲的监视点结构
-static WP *head = NULL, *free_ = NULL;
+static THREAD_LOCAL WP *head = NULL, *free_ = NULL;
+#ifdef CONFIG_REPLAY
+// number of changes seen by check_wp_value_chage(), to tell a stop of
+// the execution by a watchpoint from the end of the steps
+uint64_t wp_nr_change = 0;
+#endif
 
 void init_wp_pool() {
   int i;
@@ -53,6 +58,10 @@ void show_watch_point()
   printf("\n");
 }
 
+bool wp_active() {
+  return head != NULL;
+}
+
 bool check_wp_value_chage(word_t * old_value, word_t *change_value)
 {
   bool changed = false;
@@ -64,6 +73,7 @@ bool check_wp_value_chage(word_t * old_value, word_t *change_value)
     if (new_value != t_head->value && sucess)
     {
       changed = true;
+      IFDEF(CONFIG_REPLAY, wp_nr_change ++);
       *old_value = t_head->value;
       *change_value = new_value;
       t_head->value = expr(t_head->expr, &sucess);
@@ -228,3 +238,27 @@ bool del_wp_no(int NO)
     return false;
   }
 }
+
+#ifdef CONFIG_REPLAY
+// copy the expressions of the watchpoints in use to `exprs`
+int wp_save(char exprs[][64], int max) {
+  int n = 0;
+  for (WP *wp = head; wp != NULL && n < max; wp = wp->next) {
+    strcpy(exprs[n ++], wp->expr);
+  }
+  return n;
+}
+
+// replace the watchpoints with `exprs`, whose values are taken now
+void wp_restore(char exprs[][64], int n) {
+  while (head != NULL) {
+    WP *wp = head;
+    head = wp->next;
+    wp->next = free_;
+    free_ = wp;
+    free_wp_size ++;
+  }
+  WP *wp;
+  for (int i = 0; i < n; i ++) new_wp(&wp, exprs[i]);
+}
+#endif
@@ -0,0 +1,112 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <context.h>
+#include <memory/paddr.h>
+#include <trace.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* The entries of a chunk are collected in `buf` behind room for its
+ * header, and the whole chunk is written at once when the buffer is full.
+ * The chunk is also closed when the run stops anywhere else than where it
+ * would continue, e.g. after a checkpoint is restored, and before a fork,
+ * so a checkpoint never writes what its parent writes too.
+ */
+
+#define CHUNK_SIZE (1 << 20)
+#define MAX_ENTRY 20 // two varints of 64 bits
+
+uint64_t btrace_run = 0;
+
+static int fd = -1;
+static uint8_t buf[sizeof(BTraceChunk) + CHUNK_SIZE];
+static BTraceChunk *chunk = (BTraceChunk *)buf;
+static uint8_t *p = NULL; // NULL if no chunk is open
+static uint64_t chunk_inst = 0; // instructions in the entries of the chunk
+static uint64_t expect_pc = 0;
+
+static uint8_t* put_varint(uint8_t *q, uint64_t v) {
+  while (v >= 0x80) { *q ++ = v | 0x80; v >>= 7; }
+  *q ++ = v;
+  return q;
+}
+
+static void put_entry(uint64_t run, int64_t delta) {
+  p = put_varint(p, run);
+  p = put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+  chunk->nr_entry ++;
+  chunk_inst += run;
+  btrace_run = 0;
+}
+
+static void open_chunk(uint64_t pc, uint64_t nr_inst) {
+  *chunk = (BTraceChunk) { .pc = pc, .nr_inst = nr_inst };
+  p = buf + sizeof(BTraceChunk);
+  chunk_inst = 0;
+}
+
+static void close_chunk() {
+  if (p == NULL) return;
+  if (btrace_run > 0) put_entry(btrace_run, 0);
+  if (chunk->nr_entry > 0) {
+    chunk->size = p - buf - sizeof(BTraceChunk);
+    ssize_t n = write(fd, buf, p - buf);
+    Assert(n == p - buf, "Can not write the branch trace");
+  }
+  p = NULL;
+}
+
+void btrace_jump(uint64_t snpc, uint64_t dnpc) {
+  if (p == NULL) return;
+  put_entry(btrace_run, dnpc - snpc);
+  if (p - buf > sizeof(buf) - MAX_ENTRY) {
+    uint64_t nr_inst = chunk->nr_inst + chunk_inst;
+    close_chunk();
+    open_chunk(dnpc, nr_inst);
+  }
+}
+
+void btrace_sync(uint64_t pc) {
+  if (p != NULL && pc == expect_pc &&
+      g_nr_guest_inst == chunk->nr_inst + chunk_inst + btrace_run) return;
+  close_chunk();
+  btrace_run = 0;
+  open_chunk(pc, g_nr_guest_inst);
+}
+
+void btrace_pause(uint64_t pc) {
+  expect_pc = pc;
+}
+
+void btrace_close() {
+  if (fd < 0) return;
+  close_chunk();
+}
+
+void init_btrace(const char *log_file) {
+  char file[256];
+  snprintf(file, sizeof(file), "%s.btrace", log_file ? log_file : "nemu");
+  fd = open(file, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  Assert(fd >= 0, "Can not open '%s'", file);
+  BTraceHeader h = { .h = { .magic = BTRACE_MAGIC, .version = BTRACE_VERSION,
+    .isa = str(__GUEST_ISA__) }, .reset_vector = RESET_VECTOR };
+  Assert(write(fd, &h, sizeof(h)) == sizeof(h), "Can not write '%s'", file);
+  pthread_atfork(close_chunk, NULL, NULL);
+  atexit(btrace_close);
+  Log("The branch trace is written to %s", file);
+}
@@ -0,0 +1,56 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <context.h>
+#include <memory/paddr.h>
+
+#define CTX_INIT { .run_state = { .state = NEMU_STOP }, IFDEF(CONFIG_DEVICE, .events.deadline = UINT64_MAX) }
+
+#ifdef CONFIG_MULTI_GUEST
+void init_guest_device();
+
+static NEMUContext nemu_ctx_main = CTX_INIT;
+__thread NEMUContext *nemu_ctx = &nemu_ctx_main;
+
+NEMUContext* nemu_ctx_new() {
+  NEMUContext *ctx = calloc(1, sizeof(NEMUContext));
+  assert(ctx);
+  ctx->pmem = new_pmem();
+  ctx->run_state.state = NEMU_STOP;
+  IFDEF(CONFIG_DEVICE, ctx->events.deadline = UINT64_MAX);
+  // the devices are set up in the context they belong to
+  NEMUContext *old = nemu_ctx;
+  nemu_ctx = ctx;
+  IFDEF(CONFIG_DEVICE, init_guest_device());
+  nemu_ctx = old;
+  return ctx;
+}
+
+void nemu_ctx_free(NEMUContext *ctx) {
+  Assert(ctx != &nemu_ctx_main, "can not free the context of the first guest");
+  Assert(ctx != nemu_ctx, "can not free the running context");
+  io_space_free(&ctx->mmio);
+  io_space_free(&ctx->pio);
+  free(ctx->io_space);
+  free_pmem(ctx->pmem);
+  free(ctx);
+}
+
+void nemu_ctx_switch(NEMUContext *ctx) {
+  nemu_ctx = ctx;
+}
+#else
+NEMUContext nemu_ctx_static = CTX_INIT;
+#endif
@@ -67,13 +67,53 @@ void init_disasm() {
 #endif
 }
 
-void disassemble(char *str, int size, uint64_t pc, uint8_t *code, int nbyte) {
+void disassemble(char *str, int size, uint64_t pc, const uint8_t *code, int nbyte) {
 	cs_insn *insn;
 	size_t count = cs_disasm_dl(handle, code, nbyte, pc, 0, &insn);
-  assert(count == 1);
+  if (count != 1) {
+    // do not fail when dumping the instructions at a crash
+    snprintf(str, size, "(bad)");
+    if (count > 0) cs_free_dl(insn, count);
+    return;
+  }
   int ret = snprintf(str, size, "%s", insn->mnemonic);
   if (insn->op_str[0] != '\0') {
     snprintf(str + ret, size - ret, "\t%s", insn->op_str);
   }
   cs_free_dl(insn, count);
 }
+
+#define DISASM_CACHE_SIZE 4096
+
+/* Disassembled text by instruction word, so an instruction is only given
+ * to capstone once. x86 prints the targets of jumps, so the pc is part of
+ * the key there.
+ */
+typedef struct {
+  uint64_t pc;
+  uint8_t code[16];
+  int nbyte;
+  char text[96];
+} DisasmEntry;
+
+static __thread DisasmEntry *cache = NULL;
+
+const char* disassemble_cached(uint64_t pc, const uint8_t *code, int nbyte) {
+  if (cache == NULL) {
+    cache = calloc(DISASM_CACHE_SIZE, sizeof(DisasmEntry));
+    assert(cache);
+  }
+  uint64_t key = 0;
+  if (nbyte > (int)sizeof(cache->code)) nbyte = sizeof(cache->code);
+  memcpy(&key, code, (nbyte < 8 ? nbyte : 8));
+  IFDEF(CONFIG_ISA_x86, key ^= pc * 0x9e3779b97f4a7c15ull);
+  DisasmEntry *e = &cache[(key ^ (key >> 17) ^ (key >> 31)) % DISASM_CACHE_SIZE];
+  if (e->nbyte != nbyte || memcmp(e->code, code, nbyte) != 0 ||
+      MUXDEF(CONFIG_ISA_x86, e->pc != pc, false)) {
+    e->pc = pc;
+    e->nbyte = nbyte;
+    memcpy(e->code, code, nbyte);
+    disassemble(e->text, sizeof(e->text), pc, code, nbyte);
+  }
+  return e->text;
+}
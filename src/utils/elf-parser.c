@@ -1,18 +1,25 @@
 #include <elf-parser.h>
 #include <debug.h>
+#include <trace.h>
+#include <context.h>
 
 typedef struct
 {
-    char    st_name[32];    /* Symbol name (string tbl index) */
+    char    *st_name;       /* Symbol name */
     word_t	st_value;		/* Symbol value */
     word_t	st_size;		/* Symbol size */
+    word_t  cover_end;      /* the largest end of this and the symbols before */
 } FUNC_SYM;
 
-#define MAX_FTTRACE_FUNC_NUM 1024
+// sorted by address after each ELF is added, so that the symbol holding a
+// pc is found by binary search
 static int record_func_syn_num = 0;
-static FUNC_SYM RECORD_FUN_SYM[MAX_FTTRACE_FUNC_NUM] = {};
+static int record_func_syn_max = 0;
+static FUNC_SYM *RECORD_FUN_SYM = NULL;
+// the last symbol found, calls and returns mostly stay in a few functions
+static THREAD_LOCAL int last_hit = -1;
 
-static int func_call_depth = 0;
+static THREAD_LOCAL int func_call_depth = 0;
 
 #ifdef CONFIG_FTRACE
 // TODO: 下面的elf相关的函数应该也需要在config_FTRACE的范围内
@@ -155,6 +162,27 @@ void print_symbol_table(FILE* fp, Elf32_Ehdr eh, Elf32_Shdr sh_table[], int file
     free(shstrtab);
 }
 
+static int cmp_func_sym(const void *a, const void *b)
+{
+    const FUNC_SYM *x = a, *y = b;
+    return (x->st_value > y->st_value) - (x->st_value < y->st_value);
+}
+
+static void sort_record_func_sym()
+{
+    // the order of symbols at the same address does not matter,
+    // they hold the same pc
+    qsort(RECORD_FUN_SYM, record_func_syn_num, sizeof(FUNC_SYM), cmp_func_sym);
+    word_t end = 0;
+    for (int i = 0; i < record_func_syn_num; i++)
+    {
+        word_t e = RECORD_FUN_SYM[i].st_value + RECORD_FUN_SYM[i].st_size;
+        if (e > end) end = e;
+        RECORD_FUN_SYM[i].cover_end = end;
+    }
+    last_hit = -1;
+}
+
 void add_record_func_symbol_table(FILE* fp, Elf32_Ehdr eh, Elf32_Shdr sh_table[], int file_offset)
 {
     // seek to the section-header string-table
@@ -195,36 +223,70 @@ void add_record_func_symbol_table(FILE* fp, Elf32_Ehdr eh, Elf32_Shdr sh_table[]
 
     int num_symbols = symtab->sh_size / symtab->sh_entsize;
     for(int i=0; i< num_symbols; i++) {
-        if (ELF32_ST_TYPE(symbols[i].st_info) == STT_FUNC && record_func_syn_num < MAX_FTTRACE_FUNC_NUM)
+        // a symbol without size never holds a pc
+        if (ELF32_ST_TYPE(symbols[i].st_info) == STT_FUNC && symbols[i].st_size > 0)
         {
+            if (record_func_syn_num == record_func_syn_max) {
+                record_func_syn_max = (record_func_syn_max == 0 ? 1024 : record_func_syn_max * 2);
+                RECORD_FUN_SYM = realloc(RECORD_FUN_SYM, sizeof(FUNC_SYM) * record_func_syn_max);
+                assert(RECORD_FUN_SYM);
+            }
             RECORD_FUN_SYM[record_func_syn_num].st_size = symbols[i].st_size;
             RECORD_FUN_SYM[record_func_syn_num].st_value = symbols[i].st_value;
-            strcpy(RECORD_FUN_SYM[record_func_syn_num].st_name, (strtab_data + symbols[i].st_name));
+            RECORD_FUN_SYM[record_func_syn_num].st_name = strdup(strtab_data + symbols[i].st_name);
+            IFDEF(CONFIG_TRACE_BINARY, trace_name(TRACE_FUNC_NAME, symbols[i].st_value, symbols[i].st_size,
+                RECORD_FUN_SYM[record_func_syn_num].st_name));
             record_func_syn_num++;
             // printf("0x%08x ", symbols[i].st_value);
             // printf("0x%02x ", symbols[i].st_size);
             // printf("%s\n", (strtab_data + symbols[i].st_name));
         }
-        else if (record_func_syn_num >= MAX_FTTRACE_FUNC_NUM) {
-            Log("!!! MAX_FTTRACE_FUNC_NUM is not enough");
-        }
     }
+    sort_record_func_sym();
 
     free(symbols);
     free(strtab_data);
     free(shstrtab);
 }
 
+static inline bool func_sym_hold(int i, vaddr_t pc)
+{
+    return pc - RECORD_FUN_SYM[i].st_value < RECORD_FUN_SYM[i].st_size;
+}
+
 int find_record_func_sym(vaddr_t next_pc)
 {
-    for(int i = 0; i < record_func_syn_num; i++)
+    // only if no later symbol starts at or below the pc, which could be
+    // nested in the last one
+    if (last_hit >= 0 && func_sym_hold(last_hit, next_pc) &&
+        (last_hit + 1 == record_func_syn_num || RECORD_FUN_SYM[last_hit + 1].st_value > next_pc))
+        return last_hit;
+    // the last symbol starting at or below the pc
+    int l = 0, r = record_func_syn_num - 1, found = -1;
+    while (l <= r)
     {
-        if (next_pc >= RECORD_FUN_SYM[i].st_value && next_pc < RECORD_FUN_SYM[i].st_value + RECORD_FUN_SYM[i].st_size)
+        int m = l + (r - l) / 2;
+        if (RECORD_FUN_SYM[m].st_value <= next_pc) { found = m; l = m + 1; }
+        else r = m - 1;
+    }
+    // a symbol before may still hold the pc if the ranges are nested
+    for (int i = found; i >= 0 && RECORD_FUN_SYM[i].cover_end > next_pc; i--)
+    {
+        if (func_sym_hold(i, next_pc)) return last_hit = i;
+    }
+    return -1;
+}
+
+bool find_record_func_addr(const char *name, vaddr_t *addr) {
+    for (int i = 0; i < record_func_syn_num; i++)
+    {
+        if (strcmp(RECORD_FUN_SYM[i].st_name, name) == 0)
         {
-            return i;
+            *addr = RECORD_FUN_SYM[i].st_value;
+            return true;
         }
     }
-    return -1;
+    return false;
 }
 
 char* find_record_func_name(vaddr_t next_pc) {
@@ -248,13 +310,23 @@ bool skip_part_func_trace(int index) {
 }
 #endif
 
+// the function tracer can be switched off at run time, see cmd_trace()
+THREAD_LOCAL bool g_ftrace_enable = true;
+
 void log_ftrace(bool is_func_call, vaddr_t current_pc, vaddr_t next_pc)
 {
+    if (!g_ftrace_enable) return;
     int current_index = find_record_func_sym(current_pc);
 #ifdef CONFIG_SKIP_PART_FTRACE
     if (skip_part_func_trace(current_index)) return;
 #endif
-    log_write("-->("FMT_WORD" / %s):  ", current_pc, index < 0 ? "???" : RECORD_FUN_SYM[current_index].st_name);
+#ifdef CONFIG_TRACE_BINARY
+    // the names are looked up when the records are rendered
+    trace_emit(is_func_call ? TRACE_CALL : TRACE_RET, 0, current_pc, next_pc);
+    func_call_depth += (is_func_call ? 1 : -1);
+    return;
+#endif
+    log_write("-->("FMT_WORD" / %s):  ", current_pc, current_index < 0 ? "???" : RECORD_FUN_SYM[current_index].st_name);
 
     if (is_func_call)
     {
@@ -290,7 +362,11 @@ void load_user_elf(char* file_name, int file_offset) {
 
     if (is64BitELF(eh))
     {
-        TODO();
+        Log("Symbols of ELF64 are not supported, skip %s", file_name);
+    }
+    else if (eh.e_shnum == 0)
+    {
+        Log("No section headers in %s, skip the symbols", file_name);
     }
     else
     {
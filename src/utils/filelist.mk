@@ -13,6 +13,18 @@
 # See the Mulan PSL v2 for more details.
 #**************************************************************************************/
 
+ifndef CONFIG_TRACE_BINARY
+SRCS-BLACKLIST-y += src/utils/trace.c
+endif
+
+ifndef CONFIG_FLIGHT_RECORDER
+SRCS-BLACKLIST-y += src/utils/flight.c
+endif
+
+ifndef CONFIG_BTRACE
+SRCS-BLACKLIST-y += src/utils/btrace.c
+endif
+
 ifeq ($(CONFIG_ITRACE)$(CONFIG_IQUEUE),)
 SRCS-BLACKLIST-y += src/utils/disasm.c
 else
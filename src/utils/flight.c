@@ -0,0 +1,75 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <isa.h>
+#include <cpu/decode.h>
+#include <trace.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* The ring is a shared mapping of the file, the kernel writes its pages
+ * back even if NEMU dies without a chance to flush anything. The head is
+ * moved after the record is complete, so a record cut by the crash is not
+ * counted. It is kept in the file, a process forked for a checkpoint and
+ * resumed later appends to the same ring.
+ */
+
+static FlightHeader *hdr = NULL;
+static FlightRecord *ring = NULL;
+static uint64_t mask = 0;
+
+static inline void append(int type, int len, int rd, uint32_t inst, uint64_t a, uint64_t b) {
+  uint64_t head = hdr->head;
+  ring[head & mask] = (FlightRecord) { .type = type, .len = len, .rd = rd, .inst = inst, .a = a, .b = b };
+  __atomic_store_n(&hdr->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void flight_inst(Decode *s) {
+  int rd = isa_inst_rd(s);
+  append(TRACE_INST, s->snpc - s->pc, rd, s->isa.inst, s->pc, cpu.gpr[rd]);
+}
+
+void flight_mem(int type, uint64_t addr, int len, uint64_t data) {
+  append(type, len, 0, 0, addr, data);
+}
+
+void init_flight(const char *log_file) {
+  char file[256];
+  snprintf(file, sizeof(file), "%s.flight", log_file ? log_file : "nemu");
+  // the largest power of 2 fitting the size given
+  uint64_t nr = ((uint64_t)CONFIG_FLIGHT_RECORDER_MB << 20) / sizeof(FlightRecord);
+  while (nr & (nr - 1)) nr &= nr - 1;
+  size_t size = FLIGHT_DATA_OFFSET + nr * sizeof(FlightRecord);
+
+  // the file is not truncated, its pages may still be in the page cache,
+  // the others are allocated and mapped at once rather than on the first
+  // write of each
+  int fd = open(file, O_RDWR | O_CREAT, 0644);
+  Assert(fd >= 0, "Can not open '%s'", file);
+  Assert(ftruncate(fd, size) == 0 && posix_fallocate(fd, 0, size) == 0,
+      "Can not resize '%s' to %zu bytes", file, size);
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  Assert(p != MAP_FAILED, "Can not map '%s'", file);
+  close(fd);
+
+  hdr = p;
+  *hdr = (FlightHeader) { .h = { .magic = FLIGHT_MAGIC, .version = FLIGHT_VERSION,
+    .isa = str(__GUEST_ISA__) }, .record_size = sizeof(FlightRecord), .nr_record = nr };
+  ring = (FlightRecord *)((uint8_t *)p + FLIGHT_DATA_OFFSET);
+  mask = nr - 1;
+  Log("The last %" PRIu64 " events are recorded in %s", nr, file);
+}
@@ -14,12 +14,15 @@
 ***************************************************************************************/
 
 #include <common.h>
-
-extern uint64_t g_nr_guest_inst;
+#include <context.h>
 
 #ifndef CONFIG_TARGET_AM
 FILE *log_fp = NULL;
 
+void init_trace(const char *log_file);
+void init_flight(const char *log_file);
+void init_btrace(const char *log_file);
+
 void init_log(const char *log_file) {
   log_fp = stdout;
   if (log_file != NULL) {
@@ -28,6 +31,9 @@ void init_log(const char *log_file) {
     log_fp = fp;
   }
   Log("Log is written to %s", log_file ? log_file : "stdout");
+  IFDEF(CONFIG_TRACE_BINARY, init_trace(log_file));
+  IFDEF(CONFIG_FLIGHT_RECORDER, init_flight(log_file));
+  IFDEF(CONFIG_BTRACE, init_btrace(log_file));
 }
 
 bool log_enable() {
@@ -0,0 +1,87 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <context.h>
+#include <replay.h>
+#include <sys/mman.h>
+
+#define LOG_SIZE ((size_t)CONFIG_REPLAY_LOG_MB << 20)
+
+typedef struct {
+  uint64_t nr_inst;
+  uint32_t len;
+  uint32_t pad;
+  uint8_t data[];
+} Input;
+
+// the log is shared by all checkpoints, and `pos` is where this process
+// is in it, which is behind the end in a restarted checkpoint
+static struct {
+  size_t end;
+  bool full;
+  uint8_t data[];
+} *input_log = NULL;
+static size_t pos = 0;
+
+bool replay_mute = false;
+
+static size_t input_size(size_t len) {
+  return sizeof(Input) + ROUNDUP(len, 8);
+}
+
+bool replay_input(void *buf, size_t len) {
+  if (pos == input_log->end) return false;
+  Input *in = (Input *)(input_log->data + pos);
+  if (in->nr_inst != g_nr_guest_inst || in->len != len) {
+    Log("the replay diverges from the log at %" PRIu64 " instructions", g_nr_guest_inst);
+    replay_truncate();
+    return false;
+  }
+  memcpy(buf, in->data, len);
+  pos += input_size(len);
+  return true;
+}
+
+void record_input(const void *buf, size_t len) {
+  if (input_log->full) return;
+  if (pos + input_size(len) > LOG_SIZE - sizeof(*input_log)) {
+    Log("the input log is full, the run can not be replayed from here");
+    input_log->full = true;
+    return;
+  }
+  Input *in = (Input *)(input_log->data + pos);
+  in->nr_inst = g_nr_guest_inst;
+  in->len = len;
+  memcpy(in->data, buf, len);
+  pos += input_size(len);
+  input_log->end = pos;
+}
+
+void replay_truncate() {
+  input_log->end = pos;
+  input_log->full = false;
+}
+
+bool replay_log_full() {
+  return input_log->full;
+}
+
+void init_replay() {
+  // pages are only committed when the log reaches them
+  input_log = mmap(NULL, LOG_SIZE, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  Assert(input_log != MAP_FAILED, "can not map the input log");
+}
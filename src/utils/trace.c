@@ -0,0 +1,151 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <common.h>
+#include <context.h>
+#include <trace.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* Each thread emits records into a ring of its own, which only it writes
+ * and only the writer thread reads, so no lock is taken on the way. The
+ * writer copies whatever it finds in the rings to the file in big writes.
+ * A thread waits for room when its ring is full, no record is lost.
+ */
+
+#define RING_SIZE (1 << 16)
+
+typedef struct TraceRing {
+  TraceRecord rec[RING_SIZE];
+  _Atomic uint64_t head; // moved by the thread owning the ring
+  _Atomic uint64_t tail; // moved by the writer
+  struct TraceRing *next;
+  uint16_t id;
+} TraceRing;
+
+static _Atomic(TraceRing *) rings = NULL;
+static _Atomic int nr_ring = 0;
+static __thread TraceRing *ring = NULL;
+
+static FILE *trace_fp = NULL;
+static pthread_t writer;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic bool stop = false;
+
+static TraceRing* new_ring() {
+  TraceRing *r = calloc(1, sizeof(*r));
+  assert(r);
+  r->id = atomic_fetch_add(&nr_ring, 1);
+  r->next = atomic_load(&rings);
+  while (!atomic_compare_exchange_weak(&rings, &r->next, r));
+  return r;
+}
+
+static void append(TraceRing *r, int type, int len, uint32_t arg, uint64_t a, uint64_t b) {
+  uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  while (head - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SIZE) sched_yield();
+  r->rec[head % RING_SIZE] = (TraceRecord) { .type = type, .len = len, .thread = r->id,
+    .arg = arg, .nr_inst = g_nr_guest_inst, .a = a, .b = b };
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
+
+void trace_emit(int type, int len, uint64_t a, uint64_t b) {
+  extern bool log_enable();
+  if (trace_fp == NULL || !log_enable()) return;
+  if (unlikely(ring == NULL)) ring = new_ring();
+  append(ring, type, len, 0, a, b);
+}
+
+void trace_name(int type, uint64_t addr, uint32_t size, const char *name) {
+  if (trace_fp == NULL) return;
+  if (unlikely(ring == NULL)) ring = new_ring();
+  int n = strlen(name);
+  for (int i = 0; i == 0 || i * 8 < n; i ++) {
+    uint64_t chunk = 0;
+    memcpy(&chunk, name + i * 8, (n - i * 8 < 8 ? n - i * 8 : 8));
+    append(ring, type, i, size, addr, chunk);
+  }
+}
+
+// return the number of records written
+static uint64_t drain_locked() {
+  uint64_t nr = 0;
+  for (TraceRing *r = atomic_load(&rings); r != NULL; r = r->next) {
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    while (tail != head) {
+      // up to the end of the ring at a time
+      uint64_t n = head - tail;
+      if (n > RING_SIZE - tail % RING_SIZE) n = RING_SIZE - tail % RING_SIZE;
+      fwrite(&r->rec[tail % RING_SIZE], sizeof(TraceRecord), n, trace_fp);
+      tail += n;
+      nr += n;
+      atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+  }
+  return nr;
+}
+
+static uint64_t drain() {
+  pthread_mutex_lock(&drain_lock);
+  uint64_t nr = drain_locked();
+  pthread_mutex_unlock(&drain_lock);
+  return nr;
+}
+
+static void* writer_main(void *arg) {
+  while (!atomic_load(&stop)) {
+    if (drain() == 0) nanosleep(&(struct timespec) { .tv_nsec = 1000000 }, NULL);
+  }
+  return NULL;
+}
+
+void trace_close() {
+  if (trace_fp == NULL) return;
+  atomic_store(&stop, true);
+  pthread_join(writer, NULL);
+  drain();
+  fclose(trace_fp);
+  trace_fp = NULL;
+}
+
+// a forked process, e.g. a checkpoint, runs on with a writer of its own,
+// the records before are written once by the parent
+static void fork_prepare() {
+  pthread_mutex_lock(&drain_lock);
+  drain_locked();
+  fflush(trace_fp);
+}
+static void fork_parent() { pthread_mutex_unlock(&drain_lock); }
+static void fork_child() {
+  pthread_mutex_unlock(&drain_lock);
+  pthread_create(&writer, NULL, writer_main, NULL);
+}
+
+void init_trace(const char *log_file) {
+  char file[256];
+  snprintf(file, sizeof(file), "%s.trace", log_file ? log_file : "nemu");
+  trace_fp = fopen(file, "wb");
+  Assert(trace_fp, "Can not open '%s'", file);
+  setvbuf(trace_fp, NULL, _IOFBF, 1 << 20);
+  TraceHeader h = { .magic = TRACE_MAGIC, .version = TRACE_VERSION, .isa = str(__GUEST_ISA__) };
+  fwrite(&h, sizeof(h), 1, trace_fp);
+  pthread_create(&writer, NULL, writer_main, NULL);
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+  atexit(trace_close);
+  Log("Trace records are written to %s", file);
+}
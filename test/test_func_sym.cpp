@@ -0,0 +1,98 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <iostream>
+
+typedef uint32_t word_t;
+
+typedef struct
+{
+    const char *st_name;
+    word_t st_value;
+    word_t st_size;
+    word_t cover_end;
+} FUNC_SYM;
+
+// sorted by st_value, `outer` holds `inner`
+FUNC_SYM RECORD_FUN_SYM[] = {
+    {"_start", 0x100, 0x10},
+    {"outer",  0x200, 0x100},
+    {"inner",  0x240, 0x20},
+    {"after",  0x300, 0x10},
+};
+int record_func_syn_num = sizeof(RECORD_FUN_SYM) / sizeof(RECORD_FUN_SYM[0]);
+int last_hit = -1;
+
+bool func_sym_hold(int i, word_t pc)
+{
+    return pc - RECORD_FUN_SYM[i].st_value < RECORD_FUN_SYM[i].st_size;
+}
+
+// the same as src/utils/elf-parser.c
+int find_record_func_sym(word_t next_pc)
+{
+    if (last_hit >= 0 && func_sym_hold(last_hit, next_pc) &&
+        (last_hit + 1 == record_func_syn_num || RECORD_FUN_SYM[last_hit + 1].st_value > next_pc))
+        return last_hit;
+    int l = 0, r = record_func_syn_num - 1, found = -1;
+    while (l <= r)
+    {
+        int m = l + (r - l) / 2;
+        if (RECORD_FUN_SYM[m].st_value <= next_pc) { found = m; l = m + 1; }
+        else r = m - 1;
+    }
+    for (int i = found; i >= 0 && RECORD_FUN_SYM[i].cover_end > next_pc; i--)
+    {
+        if (func_sym_hold(i, next_pc)) return last_hit = i;
+    }
+    return -1;
+}
+
+// the innermost symbol holding the pc, which starts last
+int find_linear(word_t pc)
+{
+    for (int i = record_func_syn_num - 1; i >= 0; i--)
+    {
+        if (func_sym_hold(i, pc)) return i;
+    }
+    return -1;
+}
+
+const char *name(int i) { return i < 0 ? "???" : RECORD_FUN_SYM[i].st_name; }
+
+int main()
+{
+    word_t end = 0;
+    for (int i = 0; i < record_func_syn_num; i++)
+    {
+        word_t e = RECORD_FUN_SYM[i].st_value + RECORD_FUN_SYM[i].st_size;
+        if (e > end) end = e;
+        RECORD_FUN_SYM[i].cover_end = end;
+    }
+
+    std::cout << "====== Test1: enter outer, then call inner ======" << std::endl;
+    // last_hit is outer when inner is called, inner should still be found
+    word_t pcs[] = {0x200, 0x240, 0x25c, 0x260, 0x2fc, 0x300, 0x0, 0x108, 0x310};
+    int nr_fail = 0;
+    for (word_t pc : pcs)
+    {
+        int i = find_record_func_sym(pc), ref = find_linear(pc);
+        std::cout << std::hex << "0x" << pc << " -> " << name(i) << std::endl;
+        if (i != ref) { std::cout << "  expect " << name(ref) << std::endl; nr_fail++; }
+    }
+
+    std::cout << "====== Test2: random pcs ======" << std::endl;
+    srand(1);
+    for (int t = 0; t < 100000; t++)
+    {
+        word_t pc = rand() % 0x400;
+        int i = find_record_func_sym(pc), ref = find_linear(pc);
+        if (i != ref)
+        {
+            std::cout << std::hex << "0x" << pc << " -> " << name(i) << ", expect " << name(ref) << std::endl;
+            nr_fail++;
+        }
+    }
+
+    std::cout << (nr_fail == 0 ? "PASS" : "FAIL") << std::endl;
+    return nr_fail != 0;
+}
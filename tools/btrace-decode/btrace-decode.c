@@ -0,0 +1,352 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <capstone/capstone.h>
+#include <trace.h>
+
+// Rebuild the instruction trace from a branch trace written with
+// CONFIG_BTRACE and the image it ran, as the text of the instruction
+// tracer. The chunks are decoded by threads on their own and printed in
+// order.
+//
+// usage: btrace-decode [-j N] [-s] TRACE IMAGE
+//
+// -j N runs N threads, all the cores by default. -s only prints how many
+// instructions the trace holds and its size for each of them. IMAGE is an
+// ELF file or a raw image loaded at the reset vector.
+//
+// Instructions are disassembled with the capstone library of NEMU, found
+// under $NEMU_HOME, or shown as bytes if it is not there.
+
+typedef struct {
+  uint64_t addr, size;
+  const uint8_t *data;
+} Segment;
+
+static Segment seg[64];
+static int nr_seg = 0;
+
+static const char *isa = NULL;
+static bool is64 = false;
+static uint64_t pc_mask = UINT32_MAX;
+
+static size_t (*cs_disasm_dl)(csh handle, const uint8_t *code,
+    size_t code_size, uint64_t address, size_t count, cs_insn **insn);
+static void (*cs_free_dl)(cs_insn *insn, size_t count);
+static cs_err (*cs_open_dl)(cs_arch arch, cs_mode mode, csh *handle);
+static cs_arch arch;
+static cs_mode mode;
+static bool has_disasm = false;
+
+static void* map_file(const char *file, size_t *size) {
+  int fd = open(file, O_RDONLY);
+  if (fd < 0) { perror(file); exit(1); }
+  struct stat st;
+  fstat(fd, &st);
+  *size = st.st_size;
+  void *p = (st.st_size > 0 ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED);
+  close(fd);
+  if (p == MAP_FAILED) { fprintf(stderr, "Can not map %s\n", file); exit(1); }
+  return p;
+}
+
+static void add_segment(uint64_t addr, uint64_t size, const uint8_t *data) {
+  if (nr_seg == sizeof(seg) / sizeof(seg[0])) { fprintf(stderr, "Too many segments\n"); exit(1); }
+  seg[nr_seg ++] = (Segment) { .addr = addr, .size = size, .data = data };
+}
+
+static void load_image(const char *file, uint64_t reset_vector) {
+  size_t size;
+  const uint8_t *p = map_file(file, &size);
+  if (size < sizeof(Elf64_Ehdr) || memcmp(p, ELFMAG, SELFMAG) != 0) {
+    add_segment(reset_vector, size, p);
+    return;
+  }
+  bool elf64 = (p[EI_CLASS] == ELFCLASS64);
+  const Elf32_Ehdr *eh = (const void *)p;
+  const Elf64_Ehdr *eh64 = (const void *)p;
+  int phnum = (elf64 ? eh64->e_phnum : eh->e_phnum);
+  for (int i = 0; i < phnum; i ++) {
+    uint64_t type, off, addr, filesz;
+    if (elf64) {
+      const Elf64_Phdr *ph = (const void *)(p + eh64->e_phoff + i * eh64->e_phentsize);
+      type = ph->p_type; off = ph->p_offset; addr = ph->p_paddr; filesz = ph->p_filesz;
+    } else {
+      const Elf32_Phdr *ph = (const void *)(p + eh->e_phoff + i * eh->e_phentsize);
+      type = ph->p_type; off = ph->p_offset; addr = ph->p_paddr; filesz = ph->p_filesz;
+    }
+    if (type == PT_LOAD && filesz > 0 && off + filesz <= size) add_segment(addr, filesz, p + off);
+  }
+}
+
+// the bytes at `pc` with at least `len` of them in the image, NULL if none
+static const uint8_t* fetch(uint64_t pc, int len) {
+  for (int i = 0; i < nr_seg; i ++) {
+    if (pc - seg[i].addr < seg[i].size && seg[i].size - (pc - seg[i].addr) >= len) {
+      return seg[i].data + (pc - seg[i].addr);
+    }
+  }
+  return NULL;
+}
+
+static int inst_len(const uint8_t *inst) {
+  // riscv with the C extension has 2-byte instructions,
+  // the other ISAs supported are 4 bytes long
+  return (strncmp(isa, "riscv", 5) == 0 && (inst[0] & 0x3) != 0x3 ? 2 : 4);
+}
+
+static void init_disasm() {
+  char path[1024];
+  const char *home = getenv("NEMU_HOME");
+  snprintf(path, sizeof(path), "%s/tools/capstone/repo/libcapstone.so.5", home ? home : ".");
+  void *dl = dlopen(path, RTLD_LAZY);
+  if (dl == NULL) return;
+  cs_open_dl = dlsym(dl, "cs_open");
+  cs_disasm_dl = dlsym(dl, "cs_disasm");
+  cs_free_dl = dlsym(dl, "cs_free");
+  if (!cs_open_dl || !cs_disasm_dl || !cs_free_dl) return;
+
+  if (strcmp(isa, "mips32") == 0) { arch = CS_ARCH_MIPS; mode = CS_MODE_MIPS32; }
+  else if (strcmp(isa, "riscv32") == 0) { arch = CS_ARCH_RISCV; mode = CS_MODE_RISCV32 | CS_MODE_RISCVC; }
+  else if (strcmp(isa, "riscv64") == 0) { arch = CS_ARCH_RISCV; mode = CS_MODE_RISCV64 | CS_MODE_RISCVC; }
+  else if (strcmp(isa, "loongarch32r") == 0) { arch = CS_ARCH_LOONGARCH; mode = CS_MODE_LOONGARCH32; }
+  else return;
+  has_disasm = true;
+}
+
+// the line of each pc is kept, the code in the image never changes
+#define CACHE_SIZE (1 << 16)
+
+typedef struct {
+  uint64_t pc;
+  int len;
+  char text[112];
+} Line;
+
+typedef struct {
+  csh handle;
+  bool has_disasm;
+  Line cache[CACHE_SIZE];
+} Worker;
+
+static void format_line(Worker *w, Line *l, uint64_t pc) {
+  char *p = l->text;
+  p += sprintf(p, is64 ? "   [0x%016" PRIx64 "]:" : "   [0x%08" PRIx64 "]:", pc);
+  const uint8_t *inst = fetch(pc, 2);
+  if (inst == NULL || (inst = fetch(pc, inst_len(inst))) == NULL) {
+    sprintf(p, " (not in the image)\n");
+    l->len = 4;
+    return;
+  }
+  int len = l->len = inst_len(inst);
+  for (int i = 0; i < len; i ++) p += sprintf(p, " %02x", inst[len - 1 - i]);
+  p += sprintf(p, "%*s", (4 - len) * 3 + 1, "");
+
+  cs_insn *insn;
+  size_t count = (w->has_disasm ? cs_disasm_dl(w->handle, inst, len, pc, 0, &insn) : 0);
+  if (count == 1) {
+    snprintf(p, sizeof(l->text) - (p - l->text), "%s%s%s\n",
+        insn->mnemonic, insn->op_str[0] ? "\t" : "", insn->op_str);
+  } else {
+    sprintf(p, "\n");
+  }
+  if (count > 0) cs_free_dl(insn, count);
+}
+
+static const Line* get_line(Worker *w, uint64_t pc) {
+  Line *l = &w->cache[(pc >> 1) % CACHE_SIZE];
+  if (l->len == 0 || l->pc != pc) {
+    l->pc = pc;
+    format_line(w, l, pc);
+  }
+  return l;
+}
+
+static uint64_t get_varint(const uint8_t **q, const uint8_t *end) {
+  uint64_t v = 0;
+  for (int shift = 0; *q < end && shift < 64; shift += 7) {
+    uint8_t b = *(*q) ++;
+    v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) break;
+  }
+  return v;
+}
+
+static void decode_chunk(Worker *w, const BTraceChunk *c, FILE *out) {
+  const uint8_t *q = (const uint8_t *)(c + 1), *end = q + c->size;
+  uint64_t pc = c->pc;
+  for (uint32_t e = 0; e < c->nr_entry && q < end; e ++) {
+    uint64_t run = get_varint(&q, end);
+    uint64_t z = get_varint(&q, end);
+    int64_t delta = (z >> 1) ^ -(z & 1);
+    for (uint64_t i = 0; i < run; i ++) {
+      const Line *l = get_line(w, pc);
+      fputs(l->text, out);
+      pc = (pc + l->len) & pc_mask;
+    }
+    if (delta == 0) break;
+    pc = (pc + delta) & pc_mask;
+  }
+}
+
+static const BTraceChunk **chunks = NULL;
+static int nr_chunk = 0;
+
+// a chunk is taken by the next free thread, its text is kept until all
+// chunks before are printed, at most WINDOW chunks ahead
+#define WINDOW(nr_thread) (4 * (nr_thread))
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int next_chunk = 0, printed = 0, nr_thread = 1;
+static char **text = NULL;
+static size_t *text_size = NULL;
+
+static void* worker_main(void *arg) {
+  Worker *w = calloc(1, sizeof(Worker));
+  w->has_disasm = has_disasm && cs_open_dl(arch, mode, &w->handle) == CS_ERR_OK;
+  while (true) {
+    pthread_mutex_lock(&lock);
+    while (next_chunk < nr_chunk && next_chunk >= printed + WINDOW(nr_thread)) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    int i = next_chunk ++;
+    pthread_mutex_unlock(&lock);
+    if (i >= nr_chunk) break;
+
+    char *buf;
+    size_t size;
+    FILE *out = open_memstream(&buf, &size);
+    decode_chunk(w, chunks[i], out);
+    fclose(out);
+
+    pthread_mutex_lock(&lock);
+    text[i] = buf;
+    text_size[i] = size;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+  free(w);
+  return NULL;
+}
+
+static void print_stat(const char *file, size_t size) {
+  uint64_t nr_inst = 0, nr_entry = 0;
+  for (int i = 0; i < nr_chunk; i ++) {
+    const BTraceChunk *c = chunks[i];
+    const uint8_t *q = (const uint8_t *)(c + 1), *end = q + c->size;
+    for (uint32_t e = 0; e < c->nr_entry && q < end; e ++) {
+      nr_inst += get_varint(&q, end);
+      get_varint(&q, end);
+    }
+    nr_entry += c->nr_entry;
+  }
+  printf("%s: %d chunks, %" PRIu64 " jumps, %" PRIu64 " instructions, %zu bytes",
+      file, nr_chunk, nr_entry, nr_inst, size);
+  if (nr_inst > 0) printf(", %.3f bytes per instruction", (double)size / nr_inst);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  bool stat_only = false;
+  nr_thread = sysconf(_SC_NPROCESSORS_ONLN);
+  int o;
+  while ((o = getopt(argc, argv, "j:s")) != -1) {
+    switch (o) {
+      case 'j': nr_thread = atoi(optarg); break;
+      case 's': stat_only = true; break;
+      default: goto usage;
+    }
+  }
+  if (optind + 2 != argc || nr_thread < 1) {
+usage:
+    fprintf(stderr, "Usage: %s [-j N] [-s] TRACE IMAGE\n", argv[0]);
+    return 1;
+  }
+  const char *file = argv[optind];
+
+  size_t size;
+  const uint8_t *p = map_file(file, &size);
+  const BTraceHeader *h = (const void *)p;
+  if (size < sizeof(*h) || memcmp(h->h.magic, BTRACE_MAGIC, sizeof(h->h.magic)) != 0) {
+    fprintf(stderr, "%s is not a branch trace of NEMU\n", file);
+    return 1;
+  }
+  if (h->h.version != BTRACE_VERSION) {
+    fprintf(stderr, "%s has version %d, expecting %d\n", file, h->h.version, BTRACE_VERSION);
+    return 1;
+  }
+  static char isa_buf[sizeof(h->h.isa) + 1];
+  memcpy(isa_buf, h->h.isa, sizeof(h->h.isa));
+  isa = isa_buf;
+  if (strcmp(isa, "x86") == 0) {
+    fprintf(stderr, "Instructions of x86 can not be found without decoding them\n");
+    return 1;
+  }
+  is64 = (strcmp(isa, "riscv64") == 0);
+  if (is64) pc_mask = UINT64_MAX;
+
+  // the chunks are found one after another
+  int max_chunk = 0;
+  for (size_t off = sizeof(*h); off + sizeof(BTraceChunk) <= size; ) {
+    const BTraceChunk *c = (const void *)(p + off);
+    if (off + sizeof(*c) + c->size > size) {
+      fprintf(stderr, "%s is truncated, the last chunk is skipped\n", file);
+      break;
+    }
+    if (nr_chunk == max_chunk) {
+      max_chunk = (max_chunk == 0 ? 1024 : max_chunk * 2);
+      chunks = realloc(chunks, max_chunk * sizeof(chunks[0]));
+    }
+    chunks[nr_chunk ++] = c;
+    off += sizeof(*c) + c->size;
+  }
+
+  if (stat_only) { print_stat(file, size); return 0; }
+
+  load_image(argv[optind + 1], h->reset_vector);
+  init_disasm();
+
+  text = calloc(nr_chunk, sizeof(text[0]));
+  text_size = calloc(nr_chunk, sizeof(text_size[0]));
+  pthread_t *tid = calloc(nr_thread, sizeof(pthread_t));
+  for (int i = 0; i < nr_thread; i ++) pthread_create(&tid[i], NULL, worker_main, NULL);
+
+  for (int i = 0; i < nr_chunk; i ++) {
+    pthread_mutex_lock(&lock);
+    while (text[i] == NULL) pthread_cond_wait(&cond, &lock);
+    pthread_mutex_unlock(&lock);
+    fwrite(text[i], 1, text_size[i], stdout);
+    free(text[i]);
+    pthread_mutex_lock(&lock);
+    printed = i + 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+  for (int i = 0; i < nr_thread; i ++) pthread_join(tid[i], NULL);
+  return 0;
+}
@@ -0,0 +1,339 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+
+/* Read the INSTPAT lists of an inst.c and print a header with a decode
+ * tree for each list. The tree of the list starting at INSTPAT_START()
+ * is a nested switch on the bit fields shared by the patterns, expanded
+ * by the first INSTPAT() of the list. It jumps to the pattern matched
+ * first in the linear order, or to the end of the list if none matches.
+ * Patterns are found by the line of their INSTPAT, see include/cpu/decode.h.
+ * Each tree is checked against the linear order before it is printed.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <assert.h>
+
+#define MAX_PAT 1024
+#define MAX_GROUP 64
+
+typedef struct {
+  uint64_t key, mask;
+  int line;
+} Pattern;
+
+typedef struct {
+  char name[64];
+  int first, nr; // index into `pat`
+} Group;
+
+static Pattern pat[MAX_PAT];
+static int nr_pat = 0;
+static Group group[MAX_GROUP];
+static int nr_group = 0;
+
+static char *src = NULL;
+static const char *src_name = NULL;
+
+static void error(int line, const char *msg) {
+  fprintf(stderr, "%s:%d: %s\n", src_name, line, msg);
+  exit(1);
+}
+
+static char* load(const char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL) { perror(path); exit(1); }
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  char *buf = malloc(size + 1);
+  assert(buf);
+  size_t ret = fread(buf, 1, size, fp);
+  assert(ret == size);
+  buf[size] = '\0';
+  fclose(fp);
+  return buf;
+}
+
+// replace comments with spaces, keep newlines so that lines still match
+static void strip_comments(char *p) {
+  while (*p) {
+    if (p[0] == '/' && p[1] == '/') {
+      while (*p && *p != '\n') *p ++ = ' ';
+    } else if (p[0] == '/' && p[1] == '*') {
+      *p ++ = ' '; *p ++ = ' ';
+      while (*p && !(p[0] == '*' && p[1] == '/')) { if (*p != '\n') *p = ' '; p ++; }
+      if (*p) { *p ++ = ' '; *p ++ = ' '; }
+    } else if (*p == '"' || *p == '\'') {
+      char q = *p ++;
+      while (*p && *p != q) { if (*p == '\\' && p[1]) p ++; p ++; }
+      if (*p) p ++;
+    } else {
+      p ++;
+    }
+  }
+}
+
+static void parse_pattern(const char *str, int len, int line) {
+  if (nr_pat == MAX_PAT) error(line, "too many patterns");
+  Pattern *pt = &pat[nr_pat ++];
+  pt->key = pt->mask = 0;
+  pt->line = line;
+  int nr_bit = 0;
+  for (int i = 0; i < len; i ++) {
+    char c = str[i];
+    if (c == ' ') continue;
+    if (c != '0' && c != '1' && c != '?') error(line, "invalid character in pattern string");
+    if (++ nr_bit > 64) error(line, "pattern too long");
+    pt->key  = (pt->key  << 1) | (c == '1');
+    pt->mask = (pt->mask << 1) | (c != '?');
+  }
+}
+
+static bool is_ident(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+static void scan() {
+  int line = 1;
+  Group *g = NULL;
+  for (char *p = src; *p; p ++) {
+    if (*p == '\n') { line ++; continue; }
+    if (*p == '"') { // skip string literals outside INSTPAT()
+      for (p ++; *p && *p != '"'; p ++) { if (*p == '\\' && p[1]) p ++; }
+      if (*p == '\0') break;
+      continue;
+    }
+    if (!is_ident(*p) || (p > src && is_ident(p[-1]))) continue;
+    char *id = p;
+    while (is_ident(*p)) p ++;
+    int len = p - id;
+    char *q = p;
+    while (*q == ' ' || *q == '\t') q ++;
+    bool call = (*q == '(');
+    if (!call || strncmp(id, "INSTPAT", 7) != 0) { p --; continue; }
+    // skip `#define INSTPAT...`
+    char *bol = id;
+    while (bol > src && bol[-1] != '\n') bol --;
+    while (*bol == ' ' || *bol == '\t') bol ++;
+    if (*bol == '#') { p --; continue; }
+
+    if (len == 13 && strncmp(id, "INSTPAT_START", 13) == 0) {
+      if (g != NULL) error(line, "nested INSTPAT_START()");
+      if (nr_group == MAX_GROUP) error(line, "too many INSTPAT lists");
+      g = &group[nr_group ++];
+      q ++;
+      int n = 0;
+      while (*q != ')') {
+        if (*q == '\0' || n == sizeof(g->name) - 1) error(line, "bad INSTPAT_START()");
+        if (!isspace((unsigned char)*q)) g->name[n ++] = *q;
+        q ++;
+      }
+      g->name[n] = '\0';
+      g->first = nr_pat;
+      g->nr = 0;
+    } else if (len == 11 && strncmp(id, "INSTPAT_END", 11) == 0) {
+      if (g == NULL) error(line, "INSTPAT_END() without INSTPAT_START()");
+      g = NULL;
+    } else if (len == 7) {
+      if (g == NULL) error(line, "INSTPAT() outside INSTPAT_START()");
+      q ++;
+      while (isspace((unsigned char)*q)) q ++;
+      if (*q != '"') error(line, "the pattern of INSTPAT() should be a string literal");
+      char *end = strchr(q + 1, '"');
+      if (end == NULL) error(line, "unterminated pattern string");
+      parse_pattern(q + 1, end - q - 1, line);
+      g->nr ++;
+    }
+    p --;
+  }
+  if (g != NULL) error(line, "INSTPAT_START() without INSTPAT_END()");
+}
+
+/* tree generation */
+
+static const char *end_name = NULL; // INSTPAT_END() defines __instpat_end_<name>
+// when not NULL, gen() prints nothing and only follows the branches taken by *probe
+static const uint64_t *probe = NULL;
+
+#define emit(level, ...) do { \
+  if (probe == NULL) { indent(level); printf(__VA_ARGS__); } \
+} while (0)
+
+static void indent(int level) {
+  printf("%*s", level * 2 + 2, "");
+}
+
+// the longest run of continuous 1s in `m`
+static void longest_field(uint64_t m, int *lo, int *width) {
+  *lo = *width = 0;
+  for (int i = 0; i < 64; ) {
+    if (!(m >> i & 1)) { i ++; continue; }
+    int j = i;
+    while (j < 64 && (m >> j & 1)) j ++;
+    if (j - i > *width) { *lo = i; *width = j - i; }
+    i = j;
+  }
+}
+
+// return the line of the pattern reached by *probe, or -1 for the end of the list
+static int gen(const int *cand, int n, uint64_t decided, int level) {
+  if (n == 0) {
+    emit(level, "goto __instpat_end_%s; \\\n", end_name);
+    return -1;
+  }
+  const Pattern *p0 = &pat[cand[0]];
+  if ((p0->mask & ~decided) == 0) {
+    emit(level, "goto __instpat_%d; \\\n", p0->line);
+    return p0->line;
+  }
+
+  // the longest prefix of candidates sharing some undecided bits
+  uint64_t common = p0->mask & ~decided;
+  int j = 1;
+  while (j < n && (common & pat[cand[j]].mask) != 0) {
+    common &= pat[cand[j]].mask;
+    j ++;
+  }
+  if (j == 1) {
+    uint64_t mask = p0->mask & ~decided, key = p0->key & ~decided;
+    emit(level, "if ((__inst & 0x%llxull) == 0x%llxull) goto __instpat_%d; \\\n",
+        (unsigned long long)mask, (unsigned long long)key, p0->line);
+    if (probe != NULL && (*probe & mask) == key) return p0->line;
+    return gen(cand + 1, n - 1, decided, level);
+  }
+
+  int lo, width;
+  longest_field(common, &lo, &width);
+  uint64_t fmask = (width == 64 ? ~0ull : (1ull << width) - 1);
+  uint64_t field = fmask << lo;
+
+  int *sub = malloc(sizeof(int) * n);
+  bool *done = calloc(j, sizeof(bool));
+  assert(sub && done);
+  int ret = 0;
+  bool taken = false;
+  emit(level, "switch ((__inst >> %d) & 0x%llxull) { \\\n", lo, (unsigned long long)fmask);
+  for (int i = 0; i < j && !taken; i ++) {
+    if (done[i]) continue;
+    uint64_t v = pat[cand[i]].key & field;
+    int nr_sub = 0;
+    // keep the original order: candidates of this value, then the rest
+    for (int k = i; k < j; k ++) {
+      if ((pat[cand[k]].key & field) == v) { sub[nr_sub ++] = cand[k]; done[k] = true; }
+    }
+    // a later pattern can only match here if it agrees with `v` on the bits of
+    // `field` it cares about, the others are don't-care for it
+    for (int k = j; k < n; k ++) {
+      const Pattern *pk = &pat[cand[k]];
+      if (((pk->key ^ v) & pk->mask & field) == 0) sub[nr_sub ++] = cand[k];
+    }
+    emit(level, "case 0x%llx: \\\n", (unsigned long long)(v >> lo));
+    if (probe == NULL || (*probe & field) == v) {
+      ret = gen(sub, nr_sub, decided | field, level + 1);
+      taken = (probe != NULL);
+    }
+  }
+  if (!taken) {
+    emit(level, "default: \\\n");
+    ret = gen(cand + j, n - j, decided, level + 1);
+  }
+  emit(level, "} \\\n");
+  free(sub);
+  free(done);
+  return ret;
+}
+
+static int linear(const Group *g, uint64_t inst) {
+  for (int k = 0; k < g->nr; k ++) {
+    const Pattern *pt = &pat[g->first + k];
+    if ((inst & pt->mask) == pt->key) return pt->line;
+  }
+  return -1;
+}
+
+static uint64_t rand64() {
+  static uint64_t x = 0x9e3779b97f4a7c15ull;
+  x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+  return x;
+}
+
+static void check_one(const Group *g, const int *cand, uint64_t inst) {
+  probe = &inst;
+  int ret = gen(cand, g->nr, 0, 0);
+  probe = NULL;
+  int ref = linear(g, inst);
+  if (ret != ref) {
+    fprintf(stderr, "%s: decode tree of INSTPAT_START(%s) disagrees with the linear order "
+        "on 0x%llx: line %d instead of %d (-1 for no match)\n",
+        src_name, g->name, (unsigned long long)inst, ret, ref);
+    exit(1);
+  }
+}
+
+// compare the tree with the linear order on every pattern with random
+// don't-care bits, on every pattern with one bit flipped, and on random words
+static void check(const Group *g, const int *cand) {
+  uint64_t bits = 0;
+  for (int k = 0; k < g->nr; k ++) bits |= pat[g->first + k].mask;
+  for (int k = 0; k < g->nr; k ++) {
+    const Pattern *pt = &pat[g->first + k];
+    for (int t = 0; t < 16; t ++) {
+      uint64_t inst = pt->key | (rand64() & bits & ~pt->mask);
+      check_one(g, cand, inst);
+      for (int b = 0; b < 64; b ++) {
+        if (pt->mask >> b & 1) check_one(g, cand, inst ^ (1ull << b));
+      }
+    }
+  }
+  for (int t = 0; t < 65536; t ++) check_one(g, cand, rand64() & bits);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s inst.c > instpat-tree.h\n", argv[0]);
+    return 1;
+  }
+  src_name = argv[1];
+  src = load(src_name);
+  strip_comments(src);
+  scan();
+
+  printf("// generated by tools/gen-decode from %s, do not edit\n\n", src_name);
+  printf("#define INSTPAT_TREE 1\n\n");
+  for (int i = 0; i < nr_group; i ++) {
+    Group *g = &group[i];
+    if (g->nr == 0) continue;
+    end_name = g->name;
+
+    int *cand = malloc(sizeof(int) * g->nr);
+    assert(cand);
+    for (int k = 0; k < g->nr; k ++) cand[k] = g->first + k;
+    check(g, cand);
+    printf("#define __instpat_tree_%d { \\\n", pat[g->first].line);
+    printf("  __attribute__((unused)) uint64_t __inst = (uint64_t)INSTPAT_INST(s); \\\n");
+    gen(cand, g->nr, 0, 0);
+    printf("}\n");
+    for (int k = 1; k < g->nr; k ++) {
+      printf("#define __instpat_tree_%d\n", pat[g->first + k].line);
+    }
+    printf("\n");
+    free(cand);
+  }
+  return 0;
+}
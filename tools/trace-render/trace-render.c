@@ -0,0 +1,272 @@
+/***************************************************************************************
+* Copyright (c) 2014-2024 Zihao Yu, Nanjing University
+*
+* NEMU is licensed under Mulan PSL v2.
+* You can use this software according to the terms and conditions of the Mulan PSL v2.
+* You may obtain a copy of Mulan PSL v2 at:
+*          http://license.coscl.org.cn/MulanPSL2
+*
+* THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES OF ANY KIND,
+* EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO NON-INFRINGEMENT,
+* MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+*
+* See the Mulan PSL v2 for more details.
+***************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <dlfcn.h>
+#include <capstone/capstone.h>
+#include <trace.h>
+
+// Render a binary trace written with CONFIG_TRACE_BINARY as the text which
+// the tracers write without it, or the ring of CONFIG_FLIGHT_RECORDER.
+//
+// usage: trace-render FILE [LAST]
+//
+// LAST limits the output to the last events of a flight record.
+//
+// Instructions are disassembled with the capstone library of NEMU, found
+// under $NEMU_HOME, or shown as bytes if it is not there.
+
+typedef struct {
+  int type;
+  uint64_t addr, size;
+  char *name;
+} Name;
+
+static Name *names = NULL;
+static int nr_name = 0, max_name = 0;
+static bool sorted = true;
+
+static bool is64 = false;
+static bool is_x86 = false;
+
+static size_t (*cs_disasm_dl)(csh handle, const uint8_t *code,
+    size_t code_size, uint64_t address, size_t count, cs_insn **insn);
+static void (*cs_free_dl)(cs_insn *insn, size_t count);
+static csh handle;
+static bool has_disasm = false;
+
+static void add_name(const TraceRecord *r) {
+  char chunk[9] = {};
+  memcpy(chunk, &r->b, 8);
+  if (r->len > 0 && nr_name > 0) {
+    // the rest of a long name
+    Name *n = &names[nr_name - 1];
+    n->name = realloc(n->name, strlen(n->name) + 9);
+    strcat(n->name, chunk);
+    return;
+  }
+  if (nr_name == max_name) {
+    max_name = (max_name == 0 ? 256 : max_name * 2);
+    names = realloc(names, max_name * sizeof(Name));
+  }
+  names[nr_name ++] = (Name) { .type = r->type, .addr = r->a, .size = r->arg, .name = strdup(chunk) };
+  sorted = false;
+}
+
+static int cmp_name(const void *a, const void *b) {
+  const Name *x = a, *y = b;
+  if (x->type != y->type) return x->type - y->type;
+  return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+// the name of the range holding `addr`
+static const char* find_name(int type, uint64_t addr) {
+  if (!sorted) { qsort(names, nr_name, sizeof(Name), cmp_name); sorted = true; }
+  // the last range starting at or below `addr`
+  int l = 0, r = nr_name - 1, found = -1;
+  while (l <= r) {
+    int m = (l + r) / 2;
+    if (names[m].type < type || (names[m].type == type && names[m].addr <= addr)) { found = m; l = m + 1; }
+    else r = m - 1;
+  }
+  if (found >= 0 && names[found].type == type && addr < names[found].addr + names[found].size) {
+    return names[found].name;
+  }
+  return NULL;
+}
+
+static void init_disasm(const char *isa) {
+  char path[1024];
+  const char *home = getenv("NEMU_HOME");
+  snprintf(path, sizeof(path), "%s/tools/capstone/repo/libcapstone.so.5", home ? home : ".");
+  void *dl = dlopen(path, RTLD_LAZY);
+  if (dl == NULL) return;
+  cs_err (*cs_open_dl)(cs_arch arch, cs_mode mode, csh *handle) = dlsym(dl, "cs_open");
+  cs_err (*cs_option_dl)(csh handle, cs_opt_type type, size_t value) = dlsym(dl, "cs_option");
+  cs_disasm_dl = dlsym(dl, "cs_disasm");
+  cs_free_dl = dlsym(dl, "cs_free");
+  if (!cs_open_dl || !cs_option_dl || !cs_disasm_dl || !cs_free_dl) return;
+
+  cs_arch arch;
+  cs_mode mode;
+  if (strcmp(isa, "x86") == 0) { arch = CS_ARCH_X86; mode = CS_MODE_32; }
+  else if (strcmp(isa, "mips32") == 0) { arch = CS_ARCH_MIPS; mode = CS_MODE_MIPS32; }
+  else if (strcmp(isa, "riscv32") == 0) { arch = CS_ARCH_RISCV; mode = CS_MODE_RISCV32 | CS_MODE_RISCVC; }
+  else if (strcmp(isa, "riscv64") == 0) { arch = CS_ARCH_RISCV; mode = CS_MODE_RISCV64 | CS_MODE_RISCVC; }
+  else if (strcmp(isa, "loongarch32r") == 0) { arch = CS_ARCH_LOONGARCH; mode = CS_MODE_LOONGARCH32; }
+  else return;
+  if (cs_open_dl(arch, mode, &handle) != CS_ERR_OK) return;
+  if (is_x86) cs_option_dl(handle, CS_OPT_SYNTAX, CS_OPT_SYNTAX_ATT);
+  has_disasm = true;
+}
+
+static void render_inst(uint64_t pc, const uint8_t *inst, int ilen, int max) {
+  int nbyte = (ilen < max ? ilen : max);
+  char buf[128];
+  char *p = buf;
+  p += sprintf(p, is64 ? "   [0x%016" PRIx64 "]:" : "   [0x%08" PRIx64 "]:", pc);
+  for (int i = 0; i < nbyte; i ++) {
+    p += sprintf(p, " %02x", inst[is_x86 ? i : nbyte - 1 - i]);
+  }
+  int space_len = (is_x86 ? 8 : 4) - nbyte;
+  if (space_len < 0) space_len = 0;
+  space_len = space_len * 3 + 1;
+  memset(p, ' ', space_len);
+  p += space_len;
+  *p = '\0';
+
+  cs_insn *insn;
+  size_t count = (has_disasm && nbyte == ilen ? cs_disasm_dl(handle, inst, nbyte, pc, 0, &insn) : 0);
+  if (count == 1) {
+    printf("%s%s%s%s\n", buf, insn->mnemonic, insn->op_str[0] ? "\t" : "", insn->op_str);
+  } else {
+    printf("%s%s\n", buf, (nbyte < ilen ? "(truncated)" : ""));
+  }
+  if (count > 0) cs_free_dl(insn, count);
+}
+
+static const char* or_unknown(const char *name) { return name ? name : "???"; }
+
+static void render(const TraceRecord *r) {
+  const char *fmt_word = (is64 ? "0x%016" PRIx64 : "0x%08" PRIx64);
+  if (r->thread != 0 && r->type != TRACE_FUNC_NAME && r->type != TRACE_DEV_NAME) printf("T%d ", r->thread);
+  switch (r->type) {
+    case TRACE_INST: render_inst(r->a, (const uint8_t *)&r->b, r->len, 8); break;
+    case TRACE_MEM_READ:
+    case TRACE_MEM_WRITE:
+      printf(r->type == TRACE_MEM_READ ? "Memory Read  " : "Memory Write ");
+      printf("0x%08" PRIx64 " len: %d\n", r->a, r->len);
+      break;
+    case TRACE_CALL:
+    case TRACE_RET:
+      printf("-->(");
+      printf(fmt_word, r->a);
+      printf(" / %s):  %s  [%s@", or_unknown(find_name(TRACE_FUNC_NAME, r->a)),
+          r->type == TRACE_CALL ? "call" : "ret ", or_unknown(find_name(TRACE_FUNC_NAME, r->b)));
+      printf(fmt_word, r->b);
+      printf("]\n");
+      break;
+    case TRACE_EXCP: {
+      const char *func = find_name(TRACE_FUNC_NAME, r->a);
+      printf("[ETRACE]: deal exception No: %" PRIu64, r->b);
+      if (func) printf(", when running func: %s", func);
+      printf("\n");
+      break;
+    }
+    case TRACE_DEV_READ:
+    case TRACE_DEV_WRITE:
+      printf("@@@ %s %s @@@\n", r->type == TRACE_DEV_READ ? "read " : "write",
+          or_unknown(find_name(TRACE_DEV_NAME, r->a)));
+      break;
+    case TRACE_FUNC_NAME:
+    case TRACE_DEV_NAME: add_name(r); break;
+    default: printf("unknown record type %d\n", r->type);
+  }
+}
+
+static void render_flight(const FlightRecord *r) {
+  const char *fmt_word = (is64 ? "0x%016" PRIx64 : "0x%08" PRIx64);
+  switch (r->type) {
+    case TRACE_INST:
+      render_inst(r->a, (const uint8_t *)&r->inst, r->len, 4);
+      if (r->rd != 0) {
+        printf("      x%d = ", r->rd);
+        printf(fmt_word, r->b);
+        printf("\n");
+      }
+      break;
+    case TRACE_MEM_READ:
+    case TRACE_MEM_WRITE:
+      printf(r->type == TRACE_MEM_READ ? "Memory Read  " : "Memory Write ");
+      printf(fmt_word, r->a);
+      printf(" len: %d data: ", r->len);
+      printf(fmt_word, r->b);
+      printf("\n");
+      break;
+    default: printf("unknown record type %d\n", r->type);
+  }
+}
+
+// the ring is read from the oldest record kept
+static int flight(FILE *fp, const char *file, uint64_t last) {
+  FlightHeader h;
+  if (fseek(fp, 0, SEEK_SET) != 0 || fread(&h, sizeof(h), 1, fp) != 1 ||
+      h.record_size != sizeof(FlightRecord) || h.nr_record == 0 ||
+      (h.nr_record & (h.nr_record - 1)) != 0) {
+    fprintf(stderr, "%s is a broken flight record\n", file);
+    return 1;
+  }
+  uint64_t nr = (h.head < h.nr_record ? h.head : h.nr_record);
+  if (last < nr) nr = last;
+  fprintf(stderr, "%" PRIu64 " events recorded, showing the last %" PRIu64 "\n", h.head, nr);
+
+  static FlightRecord buf[4096];
+  for (uint64_t i = h.head - nr; i < h.head; ) {
+    // up to the end of the ring at a time
+    uint64_t slot = i & (h.nr_record - 1);
+    uint64_t n = h.head - i;
+    if (n > h.nr_record - slot) n = h.nr_record - slot;
+    if (n > 4096) n = 4096;
+    if (fseek(fp, FLIGHT_DATA_OFFSET + slot * sizeof(FlightRecord), SEEK_SET) != 0 ||
+        fread(buf, sizeof(FlightRecord), n, fp) != n) {
+      fprintf(stderr, "%s is truncated\n", file);
+      return 1;
+    }
+    for (uint64_t j = 0; j < n; j ++) render_flight(&buf[j]);
+    i += n;
+  }
+  fclose(fp);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2 && argc != 3) {
+    fprintf(stderr, "Usage: %s FILE [LAST]\n", argv[0]);
+    return 1;
+  }
+  FILE *fp = fopen(argv[1], "rb");
+  if (fp == NULL) { perror(argv[1]); return 1; }
+
+  TraceHeader h;
+  bool is_flight = false;
+  if (fread(&h, sizeof(h), 1, fp) != 1 ||
+      (memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic)) != 0 &&
+       !(is_flight = (memcmp(h.magic, FLIGHT_MAGIC, sizeof(h.magic)) == 0)))) {
+    fprintf(stderr, "%s is not a trace of NEMU\n", argv[1]);
+    return 1;
+  }
+  int version = (is_flight ? FLIGHT_VERSION : TRACE_VERSION);
+  if (h.version != version) {
+    fprintf(stderr, "%s has version %d, expecting %d\n", argv[1], h.version, version);
+    return 1;
+  }
+  h.isa[sizeof(h.isa) - 1] = '\0';
+  is64 = (strcmp(h.isa, "riscv64") == 0);
+  is_x86 = (strcmp(h.isa, "x86") == 0);
+  init_disasm(h.isa);
+  if (is_flight) return flight(fp, argv[1], argc == 3 ? strtoull(argv[2], NULL, 0) : UINT64_MAX);
+
+  static TraceRecord buf[4096];
+  size_t n;
+  while ((n = fread(buf, sizeof(TraceRecord), 4096, fp)) > 0) {
+    for (size_t i = 0; i < n; i ++) render(&buf[i]);
+  }
+  fclose(fp);
+  return 0;
+}